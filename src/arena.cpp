@@ -0,0 +1,29 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "arena.h"
+
+void LoadArena::reset()
+{
+	resource.reset();
+	// alignment padding isn't counted, leave some room for it
+	size_t wanted = usedBytes + usedBytes / 8;
+	if (wanted > block.size())
+	{
+		block.clear();
+		block.shrink_to_fit();
+		block.resize(wanted);
+	}
+	usedBytes = 0;
+
+	if (block.size())
+		resource.emplace(block.data(), block.size());
+	else
+		resource.emplace();
+}
+
+void *LoadArena::do_allocate(size_t bytes, size_t alignment)
+{
+	usedBytes += bytes;
+	if (usedBytes > peakBytes)
+		peakBytes = usedBytes;
+	return resource->allocate(bytes, alignment);
+}
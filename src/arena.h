@@ -0,0 +1,31 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include <memory_resource>
+#include <vector>
+#include <optional>
+#include <cstddef>
+
+// monotonic arena for the temporaries of a single map load, deallocation is a no-op.
+// reset() drops everything at once and keeps a block as big as the peak use,
+// so following loads are served without touching the heap. Not thread safe
+class LoadArena : public std::pmr::memory_resource
+{
+public:
+	LoadArena() { reset(); }
+
+	void reset();
+
+	size_t used() const { return usedBytes; }
+	size_t peak() const { return peakBytes; }
+
+private:
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *, size_t, size_t) override {}
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+	std::vector<std::byte> block;
+	std::optional<std::pmr::monotonic_buffer_resource> resource;
+	size_t usedBytes = 0;
+	size_t peakBytes = 0;
+};
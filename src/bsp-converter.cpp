@@ -4,11 +4,15 @@
 #include "map.h"
 #include "gltf_export.h"
 #include "wad.h"
+#include "hlbsp.h"
 #include "vpk.h"
 #include "texture.h"
 #include "rgbcx.h"
 #include "vtf.h"
+#include "cpu.h"
+#include "parallel.h"
 #include <cstring>
+#include <map>
 
 #ifdef _WIN32
 #include <direct.h>
@@ -23,34 +27,26 @@
 int handle_wad(const char *path, std::string fileName, const LoadConfig &config);
 int handle_vpk(const char *path, std::string fileName, const LoadConfig &config);
 int handle_vtf(const char *path, std::string fileName, const LoadConfig &config);
+int handle_input(const char *input, LoadConfig config);
 
 int main(int argc, const char *argv[])
 {
 	printf(HLBSP_CONVERTER_NAME "\n");
-	if (argc < 2 || !strcmp(argv[1], "-h"))
+	// every argument before the first option is a map, wad, vpk or vtf. Maps of one run share the loaded wads
+	int firstOption = 1;
+	while (firstOption < argc && argv[firstOption][0] != '-')
+		firstOption++;
+	if (firstOption == 1)
 	{
-		printf("Usage: bsp-converter map.bsp [-lm <max lightmap atlas size>] [-lstyles <light style index>|all|merge] [-skip_sky] [-uint16] [-tex] [-v]\n");
+		printf("Usage: bsp-converter map.bsp [map2.bsp ...] [-lm <max lightmap atlas size>] [-lstyles <light style index>|all|merge] [-skip_sky] [-uint16] [-merge_faces] [-batch_static] [-area_buffers] [-area_portals] [-lm_hdr rgbm|rgbe|half] [-lm_packer skyline|columns] [-lm_rotate] [-lm_pad <luxels>] [-lm_only] [-lm_scale <factor>] [-lm_filter box|lanczos] [-lm_scale_min <luxels>] [-lm_models <luxels>] [-threads <count>] [-cpu scalar|sse4|avx2] [-tex] [-mips] [-v]\n");
 		return -1;
 	}
 
 	rgbcx::init();
 
-	std::string fileName = argv[1];
-	std::string rootPath;
-	{
-		size_t p = fileName.find_last_of("/\\");
-		if (p != std::string::npos) {
-			rootPath = fileName.substr(0, p + 1);
-			fileName = fileName.substr(p + 1);
-		}
-		auto l = fileName.find_last_of('.');
-		if (l != std::string::npos)
-			fileName = fileName.substr(0, l);
-	}
-
 	LoadConfig config;
 
-	for (int i = 2; i < argc; i++)
+	for (int i = firstOption; i < argc; i++)
 	{
 		if (!strcmp(argv[i], "-game"))
 		{
@@ -93,6 +89,128 @@ int main(int argc, const char *argv[])
 				printf("Warning: '-lstyle' parameter requires a number - light style index, or a word 'all' or 'merge'\n");
 			}
 		}
+		else if (!strcmp(argv[i], "-lm_hdr"))
+		{
+			static const char *encodings[] = { "rgbm", "rgbe", "half" };
+			int e = 0;
+			for (; argc > i + 1 && e < 3; e++)
+			{
+				if (!strcmp(argv[i + 1], encodings[e]))
+					break;
+			}
+			if (argc > i + 1 && e < 3)
+			{
+				i++;
+				config.lightmapHdr = (eLightmapHdr)(e + 1);
+			}
+			else
+			{
+				printf("Warning: '-lm_hdr' parameter requires a word 'rgbm', 'rgbe' or 'half'\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_packer"))
+		{
+			if (argc > i + 1 && (!strcmp(argv[i + 1], "skyline") || !strcmp(argv[i + 1], "columns")))
+			{
+				i++;
+				config.lightmapPacker = !strcmp(argv[i], "skyline") ? eLightmapPacker::SKYLINE : eLightmapPacker::COLUMNS;
+			}
+			else
+			{
+				printf("Warning: '-lm_packer' parameter requires a word 'skyline' or 'columns'\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_rotate"))
+		{
+			config.lightmapRotate = true;
+		}
+		else if (!strcmp(argv[i], "-lm_pad"))
+		{
+			if (argc > i + 1 && atoi(argv[i + 1]) >= 0)
+			{
+				i++;
+				config.lightmapPadding = atoi(argv[i]);
+			}
+			else
+			{
+				printf("Warning: '-lm_pad' parameter requires a number of luxels\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_only"))
+		{
+			config.lightmapOnly = true;
+		}
+		else if (!strcmp(argv[i], "-lm_scale"))
+		{
+			if (argc > i + 1 && atof(argv[i + 1]) > 0 && atof(argv[i + 1]) <= 1)
+			{
+				i++;
+				config.lightmapScale = (float)atof(argv[i]);
+			}
+			else
+			{
+				printf("Warning: '-lm_scale' parameter requires a number greater than 0 and not greater than 1\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_filter"))
+		{
+			if (argc > i + 1 && (!strcmp(argv[i + 1], "box") || !strcmp(argv[i + 1], "lanczos")))
+			{
+				i++;
+				config.lightmapFilter = !strcmp(argv[i], "box") ? eLightmapFilter::BOX : eLightmapFilter::LANCZOS;
+			}
+			else
+			{
+				printf("Warning: '-lm_filter' parameter requires a word 'box' or 'lanczos'\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_scale_min"))
+		{
+			if (argc > i + 1 && atoi(argv[i + 1]) > 0)
+			{
+				i++;
+				config.lightmapScaleMin = atoi(argv[i]);
+			}
+			else
+			{
+				printf("Warning: '-lm_scale_min' parameter requires a positive number\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-lm_models"))
+		{
+			if (argc > i + 1 && atoi(argv[i + 1]) >= 0)
+			{
+				i++;
+				config.lightmapModelMin = atoi(argv[i]);
+			}
+			else
+			{
+				printf("Warning: '-lm_models' parameter requires a number of luxels\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-threads"))
+		{
+			if (argc > i + 1)
+			{
+				i++;
+				config.threads = atoi(argv[i]);
+			}
+			else
+			{
+				printf("Warning: '-threads' parameter requires a number\n");
+			}
+		}
+		else if (!strcmp(argv[i], "-cpu"))
+		{
+			if (argc > i + 1 && cpu::parseLevel(argv[i + 1], config.cpuLevel))
+			{
+				i++;
+			}
+			else
+			{
+				printf("Warning: '-cpu' parameter requires a word 'scalar', 'sse4' or 'avx2'\n");
+			}
+		}
 		else if (!strcmp(argv[i], "-skip_sky"))
 		{
 			config.skipSky = true;
@@ -101,10 +219,30 @@ int main(int argc, const char *argv[])
 		{
 			config.uint16Inds = true;
 		}
+		else if (!strcmp(argv[i], "-merge_faces"))
+		{
+			config.mergeFaces = true;
+		}
+		else if (!strcmp(argv[i], "-batch_static"))
+		{
+			config.staticBatching = true;
+		}
+		else if (!strcmp(argv[i], "-area_buffers"))
+		{
+			config.areaBuffers = true;
+		}
+		else if (!strcmp(argv[i], "-area_portals"))
+		{
+			config.areaPortals = true;
+		}
 		else if (!strcmp(argv[i], "-tex"))
 		{
 			config.allTextures = true;
 		}
+		else if (!strcmp(argv[i], "-mips"))
+		{
+			config.mips = true;
+		}
 		else if (!strcmp(argv[i], "-v"))
 		{
 			config.verbose = true;
@@ -119,14 +257,43 @@ int main(int argc, const char *argv[])
 		}
 	}
 
+	eCpuLevel cpuLevel = cpu::setLevel(config.cpuLevel);
+
 	if (config.verbose)
 	{
+		printf("Using %s kernels\n", cpu::levelName(cpuLevel));
 		if (config.skipSky)
 			printf("Sky polygons will be excluded from export\n");
 		if (config.uint16Inds)
 			printf("Set indices type to uint16\n");
 		if (config.allTextures)
 			printf("All textures will be exported\n");
+		if (config.mips)
+			printf("Smaller mip levels of wad textures will be exported\n");
+		if (config.mergeFaces)
+			printf("Coplanar faces will be merged\n");
+		if (config.staticBatching)
+			printf("Static brush entities will be baked into the world\n");
+		if (config.areaBuffers)
+			printf("Every area will get its own buffer and lightmap\n");
+		if (config.areaPortals)
+			printf("Area portals will be exported\n");
+		if (config.lightmapHdr != eLightmapHdr::NONE)
+			printf("Lightmaps will keep the HDR range\n");
+		if (config.lightmapPacker == eLightmapPacker::COLUMNS)
+			printf("Lightmaps will be packed by columns\n");
+		if (config.lightmapRotate)
+			printf("Lightmap rects can be rotated\n");
+		if (config.lightmapPadding)
+			printf("Lightmap rects will be padded by %d luxels\n", config.lightmapPadding);
+		if (config.lightmapOnly)
+			printf("Only lightmaps will be written if the cached lightmap layout is up to date\n");
+		if (config.lightmapScale < 1)
+			printf("Lightmap density will be scaled by %g with the %s filter\n", config.lightmapScale, config.lightmapFilter == eLightmapFilter::BOX ? "box" : "lanczos");
+		if (config.lightmapModelMin >= 0)
+			printf("Brush models with at least %d luxels will get their own lightmap atlas\n", config.lightmapModelMin);
+		if (config.threads)
+			printf("Geometry and wad textures will be built with %d threads\n", config.threads);
 	}
 
 	if (!config.lightmapSize)
@@ -137,22 +304,49 @@ int main(int argc, const char *argv[])
 		config.gamePath += '/';
 	}
 
+	int failed = 0;
+	for (int i = 1; i < firstOption; i++)
+	{
+		if (handle_input(argv[i], config))
+			failed++;
+		WadCache::shared().release();
+	}
+	if (firstOption > 2)
+		printf("Converted %d of %d inputs\n", firstOption - 1 - failed, firstOption - 1);
+	return failed ? -1 : 0;
+}
+
+int handle_input(const char *input, LoadConfig config)
+{
+	std::string fileName = input;
+	std::string rootPath;
+	{
+		size_t p = fileName.find_last_of("/\\");
+		if (p != std::string::npos) {
+			rootPath = fileName.substr(0, p + 1);
+			fileName = fileName.substr(p + 1);
+		}
+		auto l = fileName.find_last_of('.');
+		if (l != std::string::npos)
+			fileName = fileName.substr(0, l);
+	}
+
 	std::string mapPath;
-	if (strcasestr(argv[1], ".wad") != nullptr)
+	if (strcasestr(input, ".wad") != nullptr)
 	{
-		return handle_wad(argv[1], fileName, config);
+		return handle_wad(input, fileName, config);
 	}
-	else if (strcasestr(argv[1], ".vpk") != nullptr)
+	else if (strcasestr(input, ".vpk") != nullptr)
 	{
-		return handle_vpk(argv[1], fileName, config);
+		return handle_vpk(input, fileName, config);
 	}
-	else if (strcasestr(argv[1], ".vtf") != nullptr)
+	else if (strcasestr(input, ".vtf") != nullptr)
 	{
-		return handle_vtf(argv[1], fileName, config);
+		return handle_vtf(input, fileName, config);
 	}
-	else if (strcasestr(argv[1], ".bsp") != nullptr)
+	else if (strcasestr(input, ".bsp") != nullptr)
 	{
-		mapPath = argv[1];
+		mapPath = input;
 	}
 	else
 	{
@@ -160,7 +354,7 @@ int main(int argc, const char *argv[])
 			mapPath = config.gamePath;
 
 		mapPath += "maps/";
-		mapPath += argv[1];
+		mapPath += input;
 		mapPath += ".bsp";
 	}
 
@@ -171,13 +365,14 @@ int main(int argc, const char *argv[])
 		return -1;
 	}
 
-	if (!gltf::exportMap(fileName, map, config.verbose))
+	// the rest of the export is left from the conversion that cached the lightmap layout
+	if (!map.lightmapsOnly && !gltf::exportMap(fileName, map, config.verbose))
 	{
 		fprintf(stderr, "Export failed\n");
 		return -1;
 	}
 	if (config.verbose)
-		printf("Success");
+		printf("Success\n");
 	return 0;
 }
 
@@ -187,22 +382,67 @@ int handle_wad(const char *path, std::string fileName, const LoadConfig &config)
 	if (!wad.load(path))
 		return -1;
 
-	std::vector<uint8_t> data;
-	Texture tex;
+	// lumps are checked and named up front, so the output doesn't depend on the thread count. Of lumps with
+	// the same name the last one is written, as it used to overwrite the others
+	std::vector<std::string> names(wad.lumps.size());
+	std::map<std::string, int> lastLumps;
+	int skipped = 0, named = 0;
 	for (int i = 0; i < wad.lumps.size(); i++)
 	{
-		if (wad.lumps[i].type != WadFile::TYP_MIPTEX && wad.lumps[i].type != WadFile::TYP_GFXPIC)
+		const WadFile::lumpinfo_t &lump = wad.lumps[i];
+		if (lump.type != WadFile::TYP_MIPTEX && lump.type != WadFile::TYP_GFXPIC)
 		{
-			printf("lump %d (%s) unknown type %d\n", i, wad.lumps[i].name, wad.lumps[i].type);
+			printf("lump %d (%s) unknown type %d\n", i, lump.name, lump.type);
+			skipped++;
 			continue;
 		}
-		wad.getLump(i, data);
-		if (wad.lumps[i].type == WadFile::TYP_GFXPIC)
-			tex.name = wad.lumps[i].name;
-		if (LoadMipTexture(&data[0], tex, wad.lumps[i].type))
-			if (!config.scan)
-				tex.save((fileName + "_wad/" + tex.name + ".png").c_str(), config.verbose);
+		std::span<const uint8_t> data = wad.getLump(i);
+		if (data.empty())
+		{
+			printf("lump %d (%s) is compressed or damaged\n", i, lump.name);
+			skipped++;
+			continue;
+		}
+		// a miptex is named by its own header
+		const char *name = (lump.type == WadFile::TYP_MIPTEX && data.size() >= 16) ? (const char *)data.data() : lump.name;
+		names[i].assign(name, strnlen(name, 16));
+		lastLumps[names[i]] = i;
+		named++;
 	}
+	std::vector<bool> write(wad.lumps.size());
+	for (const auto &it : lastLumps)
+		write[it.second] = true;
+
+	// every lump is decoded into its own texture and encoded on the worker threads
+	std::atomic<int> saved{ 0 }, failed{ 0 };
+	parallelFor((int)wad.lumps.size(), config.threads, [&](int i)
+	{
+		if (!write[i])
+			return;
+		const WadFile::lumpinfo_t &lump = wad.lumps[i];
+		std::span<const uint8_t> data = wad.getLump(i);
+		Texture tex;
+		tex.name = names[i];
+		if (!LoadMipTexture(data.data(), data.size(), tex, lump.type))
+		{
+			failed++;
+			return;
+		}
+		if (config.scan || tex.save((fileName + "_wad/" + tex.name + ".png").c_str(), config.verbose))
+			saved++;
+
+		if (config.mips && lump.type == WadFile::TYP_MIPTEX)
+		{
+			for (int m = 1; m < hlbsp::MIPLEVELS; m++)
+			{
+				if (LoadMipTexture(data.data(), data.size(), tex, lump.type, m) && !config.scan)
+					tex.save((fileName + "_wad/" + tex.name + "_mip" + std::to_string(m) + ".png").c_str(), config.verbose);
+			}
+		}
+	}, 1);
+
+	printf("Extracted %d of %zu lumps, %d skipped, %d duplicate names, %d failed to decode\n", saved.load(), wad.lumps.size(), skipped,
+		named - (int)lastLumps.size(), failed.load());
 
 	return 0;
 }
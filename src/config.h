@@ -2,6 +2,30 @@
 #pragma once
 
 #include <string>
+#include "cpu.h"
+
+// how lightmaps with more than 8 bits of range (Source rgbexp) are stored
+enum class eLightmapHdr : int
+{
+	NONE,	// gamma corrected RGB8, clamped
+	RGBM,	// RGBA8 png, rgb * a * 16 gives the square root of the linear value
+	RGBE,	// RGBA8 png, Radiance shared exponent
+	HALF	// RGBA16F ktx2
+};
+
+// how lightmap rects are placed into the atlas
+enum class eLightmapPacker : int
+{
+	SKYLINE,	// bottom-left skyline with a best fit tie break, atlas size is bisected
+	COLUMNS	// Quake 2 column heights, atlas size is doubled from 32x32
+};
+
+// filter used to scale luxel blocks down
+enum class eLightmapFilter : int
+{
+	BOX,	// area average
+	LANCZOS	// lanczos3, sharper, can ring a little
+};
 
 struct LoadConfig
 {
@@ -10,10 +34,26 @@ struct LoadConfig
 	bool skipSky = false;
 	int lightmapSize = 2048;
 	int lstyle = -1;
+	eLightmapHdr lightmapHdr = eLightmapHdr::NONE;
+	eLightmapPacker lightmapPacker = eLightmapPacker::SKYLINE;
+	bool lightmapRotate = false;
+	int lightmapPadding = 0;	// free texels around every lightmap rect, filled from the nearest luxels
+	bool lightmapOnly = false;	// reuse the cached lightmap layout and write only the atlases
+	float lightmapScale = 1.0f;	// luxel density, 0.5 halves the lightmap resolution
+	eLightmapFilter lightmapFilter = eLightmapFilter::BOX;
+	int lightmapScaleMin = 4;	// faces don't go below this many luxels per side (or their own size) when scaled
+	int lightmapModelMin = -1;	// brush models with this many luxels get their own atlas, smaller ones share one; -1 - off
 	bool lstylesMerge = false;
 	bool lstylesAll = false;
 	bool uint16Inds = false;
 	bool allTextures = false;
+	bool mips = false;
+	bool mergeFaces = false;
+	bool staticBatching = false;
+	bool areaBuffers = false;
+	bool areaPortals = false;
+	int threads = 0;	// 0 - use all hardware threads
+	eCpuLevel cpuLevel = eCpuLevel::COUNT;	// capped by what the cpu supports
 
 	bool verbose = false;
 	bool scan = false;
@@ -0,0 +1,97 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "cpu.h"
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define CPU_X86_MSVC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86_GNU
+#endif
+
+static const char *levelNames[] = { "scalar", "sse4", "avx2" };
+
+static kernels_t currentKernels;
+static eCpuLevel currentLevel = eCpuLevel::COUNT;
+
+eCpuLevel cpu::detect()
+{
+#if defined(CPU_X86_GNU)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return eCpuLevel::AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return eCpuLevel::SSE41;
+#elif defined(CPU_X86_MSVC)
+	int info[4];
+	__cpuid(info, 0);
+	int maxId = info[0];
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (avx && osxsave && maxId >= 7 && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5))
+			return eCpuLevel::AVX2;
+	}
+	if (sse41)
+		return eCpuLevel::SSE41;
+#endif
+	return eCpuLevel::SCALAR;
+}
+
+eCpuLevel cpu::setLevel(eCpuLevel level)
+{
+	eCpuLevel supported = detect();
+	if (level > supported)
+		level = supported;
+
+	kernels_t k;
+	initKernelsScalar(k);
+	eCpuLevel selected = eCpuLevel::SCALAR;
+	if (level >= eCpuLevel::SSE41 && initKernelsSse41(k))
+		selected = eCpuLevel::SSE41;
+	if (level >= eCpuLevel::AVX2 && initKernelsAvx2(k))
+		selected = eCpuLevel::AVX2;
+
+	currentKernels = k;
+	currentLevel = selected;
+	return selected;
+}
+
+eCpuLevel cpu::level()
+{
+	if (currentLevel == eCpuLevel::COUNT)
+		setLevel(detect());
+	return currentLevel;
+}
+
+const char *cpu::levelName(eCpuLevel level)
+{
+	if (level < eCpuLevel::SCALAR || level >= eCpuLevel::COUNT)
+		return "unknown";
+	return levelNames[(int)level];
+}
+
+bool cpu::parseLevel(const char *name, eCpuLevel &level)
+{
+	for (int i = 0; i < (int)eCpuLevel::COUNT; i++)
+	{
+		if (!strcmp(name, levelNames[i]))
+		{
+			level = (eCpuLevel)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const kernels_t &kernels()
+{
+	if (currentLevel == eCpuLevel::COUNT)
+		cpu::setLevel(cpu::detect());
+	return currentKernels;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum class eCpuLevel : int
+{
+	SCALAR = 0,	// portable code, SSE2 on x86-64
+	SSE41,
+	AVX2,
+	COUNT
+};
+
+// hot loops with implementations for several instruction sets. All of them give bit identical results,
+// so the output never depends on the machine
+struct kernels_t
+{
+	// s = p.dot(vecS) + offS, t = p.dot(vecT) + offT for 'count' points given as separate x, y, z arrays
+	void (*texCoords)(const float *x, const float *y, const float *z, int count,
+		const float *vecS, float offS, const float *vecT, float offT, float *s, float *t);
+	// grows mins/maxs (s, t) by the same coordinates, but s uses the double precision dot product like the
+	// GoldSrc lightmap extents
+	void (*texBounds)(const float *x, const float *y, const float *z, int count,
+		const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs);
+	// u = (s - subS + addS + half) / width, v = (t - subT + addT + half) / height, per point offsets
+	void (*lightmapCoords)(const float *s, const float *t, int count, const float *subS, const float *addS,
+		const float *subT, const float *addT, float half, float width, float height, float *u, float *v);
+	// grows mins/maxs by 'count' xyz float positions laid out 'stride' bytes apart
+	void (*bounds)(const void *positions, size_t count, size_t stride, float *mins, float *maxs);
+	// normals of a width x width displacement grid, xyz positions and normals are laid out 'stride' bytes apart.
+	// A normal is the average of the unit normals of the 8 triangles around the vertex, 2 per quad.
+	// scratch holds width * width * 9 floats
+	void (*dispNormals)(const void *positions, void *normals, size_t stride, int width, float *scratch);
+	// swaps red and blue of RGB (channels 3) or RGBA (channels 4) pixels, forceAlpha also sets alpha to 255
+	void (*swapRB)(uint8_t *data, size_t pixels, int channels, bool forceAlpha);
+	// dst = palette[ids[i]] for 'count' pixels, entries are 4 bytes, channels 3 writes only the first 3 of them
+	void (*expandPalette)(const uint8_t *ids, size_t count, const uint32_t *palette, uint8_t *dst, int channels);
+	// 'count' rgbexp luxels to RGB8. table holds the decoded channel for exponent << 8 | value, the color is
+	// scaled down when a channel goes above 1. Writes only count * 3 bytes
+	void (*decodeRgbExp)(const uint8_t *src, size_t count, const float *table, uint8_t *dst);
+	// 'count' rgbexp luxels to linear HDR, values are clamped to 65504 (the half float maximum).
+	// RGBM writes RGBA8: sqrt of the value over 16 in rgb, the multiplier in a (rgbm clamps at 256).
+	// RGBE writes RGBA8 with the Radiance shared exponent, HALF writes RGBA16F with alpha 1
+	void (*encodeRgbm)(const uint8_t *src, size_t count, uint8_t *dst);
+	void (*encodeRgbe)(const uint8_t *src, size_t count, uint8_t *dst);
+	void (*encodeHalf)(const uint8_t *src, size_t count, uint8_t *dst);
+	// dst[i] = min(dst[i] + src[i], 255) for 'size' bytes
+	void (*addSaturate)(uint8_t *dst, const uint8_t *src, size_t size);
+	// dst[i] += src[i] * weight for 'count' floats, without fused multiply-add
+	void (*scaleAdd)(float *dst, const float *src, float weight, size_t count);
+};
+
+namespace cpu
+{
+	// the best level supported by this cpu and build
+	eCpuLevel detect();
+	// selects the kernels of the level, or of the best supported one below it. Returns the selected level
+	eCpuLevel setLevel(eCpuLevel level);
+	eCpuLevel level();
+
+	const char *levelName(eCpuLevel level);
+	bool parseLevel(const char *name, eCpuLevel &level);
+}
+
+const kernels_t &kernels();
+
+// per level implementations, they override only the kernels they have.
+// Files of the levels above SCALAR are built with extra instruction sets, so they must not
+// include headers with inline code shared with other files (the linker may keep the wrong copy)
+void initKernelsScalar(kernels_t &k);
+bool initKernelsSse41(kernels_t &k);
+bool initKernelsAvx2(kernels_t &k);
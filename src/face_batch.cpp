@@ -0,0 +1,26 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "face_batch.h"
+
+// LSD radix sort by bytes, passes where all keys have the same byte are skipped
+void FaceBatches::sort()
+{
+	scratch.resize(entries.size());
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t counts[257] = {};
+		for (const auto &e : entries)
+			counts[((e.key >> shift) & 0xFF) + 1]++;
+
+		bool trivial = false;
+		for (int b = 1; b <= 256 && !trivial; b++)
+			trivial = (counts[b] == entries.size());
+		if (trivial)
+			continue;
+
+		for (int b = 0; b < 256; b++)
+			counts[b + 1] += counts[b];
+		for (const auto &e : entries)
+			scratch[counts[(e.key >> shift) & 0xFF]++] = e;
+		entries.swap(scratch);
+	}
+}
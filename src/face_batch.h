@@ -0,0 +1,73 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include <vector>
+#include <memory_resource>
+#include <cstdint>
+#include <cstddef>
+
+// groups faces into meshes and submeshes: one flat array of packed keys sorted with a radix sort,
+// batches are the runs of equal keys
+class FaceBatches
+{
+public:
+	// key bits from high to low: model 12, group (area or lightmap atlas) 12, page inside the atlas 12, material 16,
+	// source model 12
+	enum : uint64_t
+	{
+		MODEL_BITS = 0xFFF0000000000000ull,
+		GROUP_BITS = 0xFFFFFF0000000000ull,
+		PAGE_BITS = 0xFFFFFFFFF0000000ull,
+		MATERIAL_BITS = 0xFFFFFFFFFFFFF000ull
+	};
+	// lightmap pages one atlas may take, loaders fail above it instead of wrapping the page
+	static const int MAX_PAGES = 0x1000;
+
+	struct entry_t
+	{
+		uint64_t key;
+		int face;
+	};
+
+	FaceBatches(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : entries(resource), scratch(resource) {}
+
+	// sourceModel orders faces baked into another model, -1 means the same as model
+	static uint64_t makeKey(int model, int group, int page, int material, int sourceModel = -1)
+	{
+		if (sourceModel == -1)
+			sourceModel = model;
+		// the group can be negative, the bias keeps the order
+		return (uint64_t(model & 0xFFF) << 52) | (uint64_t((group + 0x800) & 0xFFF) << 40) | (uint64_t(page & 0xFFF) << 28) |
+			(uint64_t(uint16_t(material)) << 12) | uint64_t(sourceModel & 0xFFF);
+	}
+
+	void add(int model, int group, int page, int material, int face, int sourceModel = -1)
+	{
+		entries.push_back({ makeKey(model, group, page, material, sourceModel), face });
+	}
+
+	// stable, faces with the same key keep the order they were added in
+	void sort();
+
+	// end of the run of entries which have the same key bits under 'mask' as the entry at 'begin'
+	size_t runEnd(size_t begin, uint64_t mask) const
+	{
+		const uint64_t k = entries[begin].key & mask;
+		size_t end = begin + 1;
+		while (end < entries.size() && (entries[end].key & mask) == k)
+			end++;
+		return end;
+	}
+
+	int model(size_t i) const { return int(entries[i].key >> 52); }
+	int group(size_t i) const { return int((entries[i].key >> 40) & 0xFFF) - 0x800; }
+	int page(size_t i) const { return int((entries[i].key >> 28) & 0xFFF); }
+	int material(size_t i) const { return int((entries[i].key >> 12) & 0xFFFF); }
+	int sourceModel(size_t i) const { return int(entries[i].key & 0xFFF); }
+
+	std::pmr::vector<entry_t> entries;
+
+private:
+	// radix sort output, swapped with entries on every pass and kept for the next sort
+	std::pmr::vector<entry_t> scratch;
+};
@@ -0,0 +1,303 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "face_merge.h"
+#include <unordered_map>
+#include <cstdint>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+
+static const float CONVEX_EPSILON = 1e-4f;
+
+static uint64_t edgeKey(int a, int b)
+{
+	return (uint64_t(uint32_t(a)) << 32) | uint32_t(b);
+}
+
+// Newell's method, works for any simple outline and doesn't care about collinear vertices
+template<typename F>
+static vec3_t polygonNormal(int count, F point)
+{
+	vec3_t n{ 0, 0, 0 };
+	for (int i = 0; i < count; i++)
+	{
+		const vec3_t &a = point(i);
+		const vec3_t &b = point((i + 1) % count);
+		n.x += (a.y - b.y) * (a.z + b.z);
+		n.y += (a.z - b.z) * (a.x + b.x);
+		n.z += (a.x - b.x) * (a.y + b.y);
+	}
+	return n;
+}
+
+int FaceMerger::merge(std::vector<polygon_t> &polys, const std::function<bool(const polygon_t &)> &accept)
+{
+	if (polys.size() < 2)
+		return 0;
+
+	const polygon_t &first = polys[0];
+	vec3_t normal = polygonNormal((int)first.corners.size(), [&](int i) -> const vec3_t & { return positions[first.corners[i].vertex]; });
+	if (normal.dot(normal) == 0)
+		return 0;
+	normal.normalize();
+
+	std::unordered_map<uint64_t, int> edgeOwners;
+	for (int p = 0; p < polys.size(); p++)
+	{
+		const auto &c = polys[p].corners;
+		for (int k = 0; k < c.size(); k++)
+			edgeOwners[edgeKey(c[k].vertex, c[(k + 1) % c.size()].vertex)] = p;
+	}
+
+	std::vector<bool> absorbed(polys.size(), false);
+	int mergedCount = 0;
+	polygon_t result;
+	for (int p = 0; p < polys.size(); p++)
+	{
+		if (absorbed[p])
+			continue;
+
+		bool changed = true;
+		while (changed)
+		{
+			changed = false;
+			const auto &c = polys[p].corners;
+			for (int k = 0; k < c.size(); k++)
+			{
+				int a = c[k].vertex;
+				int b = c[(k + 1) % c.size()].vertex;
+				auto it = edgeOwners.find(edgeKey(b, a));
+				if (it == edgeOwners.end() || it->second == p || absorbed[it->second])
+					continue;
+
+				int q = it->second;
+				if (!join(polys[p], k, polys[q], result))
+					continue;
+				if (!isConvex(result, normal) || (accept && !accept(result)))
+					continue;
+
+				edgeOwners.erase(edgeKey(a, b));
+				edgeOwners.erase(edgeKey(b, a));
+				const auto &rc = result.corners;
+				for (int j = 0; j < rc.size(); j++)
+					edgeOwners[edgeKey(rc[j].vertex, rc[(j + 1) % rc.size()].vertex)] = p;
+
+				std::swap(polys[p], result);
+				absorbed[q] = true;
+				mergedCount++;
+				changed = true;
+				break;
+			}
+		}
+	}
+
+	size_t n = 0;
+	for (size_t p = 0; p < polys.size(); p++)
+	{
+		if (absorbed[p])
+			continue;
+		if (n != p)
+			polys[n] = std::move(polys[p]);
+		n++;
+	}
+	polys.resize(n);
+
+	return mergedCount;
+}
+
+// p has the edge a->b starting at corner 'edge', q must contain the opposite edge b->a
+bool FaceMerger::join(const polygon_t &p, int edge, const polygon_t &q, polygon_t &out) const
+{
+	const int np = (int)p.corners.size();
+	const int nq = (int)q.corners.size();
+	const int a = p.corners[edge].vertex;
+	const int b = p.corners[(edge + 1) % np].vertex;
+
+	int m = 0;
+	for (; m < nq; m++)
+	{
+		if (q.corners[m].vertex == b && q.corners[(m + 1) % nq].vertex == a)
+			break;
+	}
+	if (m == nq)
+		return false;
+
+	out.faces = p.faces;
+	out.faces.insert(out.faces.end(), q.faces.begin(), q.faces.end());
+
+	// p from b around to a, then q strictly between a and b
+	out.corners.clear();
+	for (int i = 0; i < np; i++)
+		out.corners.push_back(p.corners[(edge + 1 + i) % np]);
+	for (int i = 2; i < nq; i++)
+		out.corners.push_back(q.corners[(m + i) % nq]);
+
+	// like qbsp, drop the ends of the shared edge if they became collinear, that is where triangles are saved
+	if (isCollinear(out, np - 1))
+		out.corners.erase(out.corners.begin() + (np - 1));
+	if (isCollinear(out, 0))
+		out.corners.erase(out.corners.begin());
+
+	return true;
+}
+
+bool FaceMerger::isCollinear(const polygon_t &p, int i) const
+{
+	const int n = (int)p.corners.size();
+	if (n <= 3)
+		return false;
+	const vec3_t &v0 = positions[p.corners[(i + n - 1) % n].vertex];
+	const vec3_t &v1 = positions[p.corners[i].vertex];
+	const vec3_t &v2 = positions[p.corners[(i + 1) % n].vertex];
+	vec3_t e1 = v1 - v0;
+	vec3_t e2 = v2 - v1;
+	float l = sqrtf(e1.dot(e1) * e2.dot(e2));
+	if (l == 0 || e1.dot(e2) <= 0)
+		return false;
+	vec3_t c = e1.cross(e2);
+	return c.dot(c) <= (CONVEX_EPSILON * l) * (CONVEX_EPSILON * l);
+}
+
+bool FaceMerger::isConvex(const polygon_t &p, const vec3_t &normal) const
+{
+	const int n = (int)p.corners.size();
+	for (int i = 0; i < n; i++)
+	{
+		const vec3_t &v0 = positions[p.corners[(i + n - 1) % n].vertex];
+		const vec3_t &v1 = positions[p.corners[i].vertex];
+		const vec3_t &v2 = positions[p.corners[(i + 1) % n].vertex];
+		vec3_t e1 = v1 - v0;
+		vec3_t e2 = v2 - v1;
+		float l = sqrtf(e1.dot(e1) * e2.dot(e2));
+		if (l == 0)
+			return false;
+
+		float s = e1.cross(e2).dot(normal) / l;
+		if (s < -CONVEX_EPSILON)
+			return false;
+		// collinear vertices are fine, but the outline must not turn back
+		if (s <= CONVEX_EPSILON && e1.dot(e2) < 0)
+			return false;
+	}
+	return true;
+}
+
+static bool pointInTriangle(const vec3_t &p, const vec3_t &a, const vec3_t &b, const vec3_t &c, const vec3_t &normal)
+{
+	return (b - a).cross(p - a).dot(normal) > 0 &&
+		(c - b).cross(p - b).dot(normal) > 0 &&
+		(a - c).cross(p - c).dot(normal) > 0;
+}
+
+// 1 for equilateral, goes to 0 for slivers
+static float triangleQuality(const vec3_t &a, const vec3_t &b, const vec3_t &c, float area2)
+{
+	float l = a.dist2(b) + b.dist2(c) + c.dist2(a);
+	return l > 0 ? (2.0f * sqrtf(3.0f) * area2 / l) : 0;
+}
+
+void FaceMerger::triangulate(const vec3_t *points, int count, std::vector<int> &tris)
+{
+	if (count < 3)
+		return;
+
+	vec3_t normal = polygonNormal(count, [&](int i) -> const vec3_t & { return points[i]; });
+	float nl = sqrtf(normal.dot(normal));
+	if (nl == 0)
+		return;
+	normal *= 1.0f / nl;
+
+	std::vector<int> ids(count);
+	for (int i = 0; i < count; i++)
+		ids[i] = i;
+
+	while (ids.size() > 3)
+	{
+		const int n = (int)ids.size();
+		int best = -1;
+		float bestQuality = -1;
+		int fallback = 0;
+		float fallbackArea = -FLT_MAX;
+		for (int i = 0; i < n; i++)
+		{
+			int i0 = ids[(i + n - 1) % n];
+			int i1 = ids[i];
+			int i2 = ids[(i + 1) % n];
+			const vec3_t &a = points[i0];
+			const vec3_t &b = points[i1];
+			const vec3_t &c = points[i2];
+			float area2 = (b - a).cross(c - b).dot(normal);
+			if (area2 > fallbackArea)
+			{
+				fallbackArea = area2;
+				fallback = i;
+			}
+
+			float l = sqrtf((b - a).dot(b - a) * (c - b).dot(c - b));
+			if (l == 0 || area2 / l <= CONVEX_EPSILON)
+				continue;
+
+			bool empty = true;
+			for (int j = 0; j < n && empty; j++)
+			{
+				int id = ids[j];
+				if (id == i0 || id == i1 || id == i2)
+					continue;
+				empty = !pointInTriangle(points[id], a, b, c, normal);
+			}
+			if (!empty)
+				continue;
+
+			float q = triangleQuality(a, b, c, area2);
+			if (q > bestQuality)
+			{
+				bestQuality = q;
+				best = i;
+			}
+		}
+
+		// nothing clean left (degenerate outline), clip the widest corner
+		if (best == -1)
+			best = fallback;
+
+		int i0 = ids[(best + n - 1) % n];
+		int i1 = ids[best];
+		int i2 = ids[(best + 1) % n];
+		if ((points[i1] - points[i0]).cross(points[i2] - points[i1]).dot(normal) > 0)
+		{
+			tris.push_back(i0);
+			tris.push_back(i1);
+			tris.push_back(i2);
+		}
+		ids.erase(ids.begin() + best);
+	}
+
+	if ((points[ids[1]] - points[ids[0]]).cross(points[ids[2]] - points[ids[1]]).dot(normal) > 0)
+	{
+		tris.push_back(ids[0]);
+		tris.push_back(ids[1]);
+		tris.push_back(ids[2]);
+	}
+}
+
+FaceMerger::luxelBounds_t FaceMerger::luxelBounds(const polygon_t &poly, const luxelBounds_t *faceBounds)
+{
+	luxelBounds_t bounds{ { INT_MAX, INT_MAX }, { INT_MIN, INT_MIN } };
+	for (int fi : poly.faces)
+	{
+		const luxelBounds_t &fb = faceBounds[fi];
+		bounds.mins.x = std::min(bounds.mins.x, fb.mins.x);
+		bounds.mins.y = std::min(bounds.mins.y, fb.mins.y);
+		bounds.maxs.x = std::max(bounds.maxs.x, fb.maxs.x);
+		bounds.maxs.y = std::max(bounds.maxs.y, fb.maxs.y);
+	}
+	return bounds;
+}
+
+bool FaceMerger::acceptLuxelBounds(const polygon_t &poly, const luxelBounds_t *faceBounds)
+{
+	const luxelBounds_t &first = faceBounds[poly.faces[0]];
+	if ((first.maxs.x - first.mins.x) * (first.maxs.y - first.mins.y) == 0)
+		return true;
+	const luxelBounds_t bounds = luxelBounds(poly, faceBounds);
+	return (bounds.maxs.x - bounds.mins.x <= MAX_MERGED_LUXELS) && (bounds.maxs.y - bounds.mins.y <= MAX_MERGED_LUXELS);
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include "vector_math.h"
+#include <vector>
+#include <functional>
+
+// joins adjacent coplanar faces into bigger convex polygons
+class FaceMerger
+{
+public:
+	struct corner_t
+	{
+		int face;	// source face
+		int index;	// corner index inside the source face
+		int vertex;	// shared vertex id, used to find common edges
+	};
+
+	struct polygon_t
+	{
+		std::vector<int> faces;	// first one is the owner of the polygon
+		std::vector<corner_t> corners;
+	};
+
+	// lightmap extents of a face in luxels, maxs is exclusive. Faces without a lightmap have an empty box
+	struct luxelBounds_t
+	{
+		vec2i_t mins;
+		vec2i_t maxs;
+	};
+
+	// merged polygons share one lightmap block, keep it small enough to pack well
+	static const int MAX_MERGED_LUXELS = 64;
+
+	FaceMerger(const vec3_t *positions_) : positions(positions_) {}
+
+	// polys must lie on one plane and share all surface properties.
+	// Merges them in place and returns the number of absorbed polygons
+	int merge(std::vector<polygon_t> &polys, const std::function<bool(const polygon_t &)> &accept = nullptr);
+
+	// ear clipping which picks the best shaped ear on every step and drops zero area triangles.
+	// Writes triangles as corner index triples in the winding order of the outline
+	static void triangulate(const vec3_t *points, int count, std::vector<int> &tris);
+
+	// union of the lightmap extents of all faces of the polygon, faceBounds is indexed by face
+	static luxelBounds_t luxelBounds(const polygon_t &poly, const luxelBounds_t *faceBounds);
+	// merge filter: unlit polygons always pass, lit ones must fit in MAX_MERGED_LUXELS
+	static bool acceptLuxelBounds(const polygon_t &poly, const luxelBounds_t *faceBounds);
+
+	// gives every lit polygon a single lightmap rect covering all of its faces. The first face gets it,
+	// the other faces are left without one. polyMins receives the luxel mins of every polygon
+	template<typename Rects, typename Mins>
+	static void fitLightmapRects(const std::vector<polygon_t> &polys, const luxelBounds_t *faceBounds, Rects &rects, Mins &polyMins)
+	{
+		polyMins.resize(polys.size());
+		for (size_t pi = 0; pi < polys.size(); pi++)
+		{
+			const polygon_t &poly = polys[pi];
+			auto &rect = rects[poly.faces[0]];
+			if (rect.w * rect.h == 0)
+				continue;
+			const luxelBounds_t bounds = luxelBounds(poly, faceBounds);
+			for (int fi : poly.faces)
+				rects[fi].w = rects[fi].h = 0;
+			polyMins[pi] = bounds.mins;
+			rect.w = bounds.maxs.x - bounds.mins.x;
+			rect.h = bounds.maxs.y - bounds.mins.y;
+		}
+	}
+
+private:
+	bool join(const polygon_t &p, int edge, const polygon_t &q, polygon_t &out) const;
+	bool isConvex(const polygon_t &p, const vec3_t &normal) const;
+	bool isCollinear(const polygon_t &p, int corner) const;
+
+	const vec3_t *positions = nullptr;
+};
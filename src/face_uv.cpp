@@ -0,0 +1,27 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "face_uv.h"
+#include "cpu.h"
+
+// the kernels follow the operation order of the scalar code, no reassociation or fma
+
+void faceuv::texCoords(const float *x, const float *y, const float *z, int count,
+	const vec3_t &vecS, float offS, const vec3_t &vecT, float offT, float *s, float *t)
+{
+	kernels().texCoords(x, y, z, count, &vecS.x, offS, &vecT.x, offT, s, t);
+}
+
+void faceuv::texBounds(const float *x, const float *y, const float *z, int count,
+	const vec3_t &vecS, float offS, const vec3_t &vecT, float offT, vec2_t &mins, vec2_t &maxs)
+{
+	float mn[2] = { mins.x, mins.y }, mx[2] = { maxs.x, maxs.y };
+	kernels().texBounds(x, y, z, count, &vecS.x, offS, &vecT.x, offT, mn, mx);
+	mins = { mn[0], mn[1] };
+	maxs = { mx[0], mx[1] };
+}
+
+void faceuv::lightmapCoords(const float *s, const float *t, int count,
+	const float *subS, const float *addS, const float *subT, const float *addT,
+	float half, float width, float height, float *u, float *v)
+{
+	kernels().lightmapCoords(s, t, count, subS, addS, subT, addT, half, width, height, u, v);
+}
@@ -0,0 +1,22 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include "vector_math.h"
+
+// texture coordinate kernels for the corners of a face. Positions come as separate x, y, z arrays,
+// the work goes to kernels() of the selected cpu level. Results are bit exact with the scalar vec3_t::dot and dot_d math
+namespace faceuv
+{
+	// s = p.dot(vecS) + offS, t = p.dot(vecT) + offT
+	void texCoords(const float *x, const float *y, const float *z, int count,
+		const vec3_t &vecS, float offS, const vec3_t &vecT, float offT, float *s, float *t);
+
+	// bounds of the same coordinates, but s uses the double precision dot product like the GoldSrc lightmap extents
+	void texBounds(const float *x, const float *y, const float *z, int count,
+		const vec3_t &vecS, float offS, const vec3_t &vecT, float offT, vec2_t &mins, vec2_t &maxs);
+
+	// u = (s - subS + addS + half) / width, v = (t - subT + addT + half) / height, per corner offsets
+	void lightmapCoords(const float *s, const float *t, int count,
+		const float *subS, const float *addS, const float *subT, const float *addT,
+		float half, float width, float height, float *u, float *v);
+}
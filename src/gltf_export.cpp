@@ -4,7 +4,10 @@
 #include "nlohmann/json.hpp"
 #include "map.h"
 #include "bsp-converter.h"
+#include "cpu.h"
 #include <cfloat>
+#include <map>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <direct.h>
@@ -34,20 +37,111 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 	int bufferViewId = 0;
 	int meshId = 0;
 	int nodeId = 1;
-	const int vertBufferOffset = 0;
-	const size_t dispVertBufferOffset = map.vertices.size() * sizeof(map.vertices[0]);
-	const size_t indsBufferOffset = dispVertBufferOffset + map.dispVertices.size() * sizeof(map.dispVertices[0]);
 	const size_t indSize = map.indices16.size() ? sizeof(uint16_t) : sizeof(uint32_t);
 	const int indType = map.indices16.size() ? UNSIGNED_SHORT : UNSIGNED_INT;
 
+	// every mesh is written into its buffer as a slice of vertices and a slice of indices.
+	// Slices keep the loader order, so a single buffer has the same layout as the arrays
+	enum
+	{
+		MESH_SURFACES,
+		MESH_DISPLACEMENTS,
+		MESH_PORTALS
+	};
+	auto vertexSize = [&](int kind) -> size_t
+	{
+		if (kind == MESH_DISPLACEMENTS)
+			return sizeof(map.dispVertices[0]);
+		if (kind == MESH_PORTALS)
+			return sizeof(map.portalVertices[0]);
+		return sizeof(map.vertices[0]);
+	};
+	struct slice_t
+	{
+		const Map::mesh_t *mesh;
+		int kind;
+		size_t vertByteOffset;
+		size_t indByteOffset;
+	};
+	const int bufferCount = std::max(1, (int)map.bufferNames.size());
+	std::vector<std::vector<slice_t> > vertSlices(bufferCount);
+	std::vector<std::vector<slice_t *> > indSlices(bufferCount);
+	std::vector<size_t> bufferLengths(bufferCount, 0);
+	std::map<const Map::mesh_t *, const slice_t *> meshSlices;
+	for (const auto &model : map.models)
+	{
+		if (model.batched)
+			continue;
+		for (const auto &part : model.meshes)
+		{
+			if (part.vertCount)
+				vertSlices[part.buffer].push_back({ &part, MESH_SURFACES });
+		}
+		for (const auto &part : model.dispMeshes)
+		{
+			if (part.vertCount)
+				vertSlices[part.buffer].push_back({ &part, MESH_DISPLACEMENTS });
+		}
+		for (const auto &part : model.portalMeshes)
+		{
+			if (part.vertCount)
+				vertSlices[part.buffer].push_back({ &part, MESH_PORTALS });
+		}
+	}
+	for (int b = 0; b < bufferCount; b++)
+	{
+		auto &slices = vertSlices[b];
+		std::stable_sort(slices.begin(), slices.end(), [](const slice_t &s1, const slice_t &s2) {
+			return s1.kind != s2.kind ? s1.kind < s2.kind : s1.mesh->vertOffset < s2.mesh->vertOffset;
+		});
+		size_t offset = 0;
+		for (auto &slice : slices)
+		{
+			slice.vertByteOffset = offset;
+			offset += slice.mesh->vertCount * vertexSize(slice.kind);
+			indSlices[b].push_back(&slice);
+			meshSlices[slice.mesh] = &slice;
+		}
+		std::stable_sort(indSlices[b].begin(), indSlices[b].end(), [](const slice_t *s1, const slice_t *s2) {
+			return s1->mesh->offset < s2->mesh->offset;
+		});
+		for (auto *slice : indSlices[b])
+		{
+			slice->indByteOffset = offset;
+			offset += slice->mesh->count * indSize;
+		}
+		bufferLengths[b] = offset;
+	}
+
+	// materials used with more than one lightmap atlas get a copy for every extra atlas
+	std::map<std::pair<int, int>, int> materialVariants;
+	auto materialIndex = [&](int material, int lightmap)
+	{
+		if (lightmap == 0)
+			return material;
+		return materialVariants.emplace(std::make_pair(material, lightmap), (int)(map.materials.size() + materialVariants.size())).first->second;
+	};
+
+	std::map<const Map::mesh_t *, int> meshNodes;
 	for (int i = 0; i < map.models.size(); i++)
 	{
+		if (map.models[i].batched)
+			continue;
+
 		int modelNodeId = nodeId;
 		nodeId++;
 		nodes[modelNodeId] = { {"name",std::string("*") + std::to_string(i)} };
 		nodes[0]["children"].push_back(modelNodeId);
 
-		bool singleMesh = (map.models[i].meshes.size() + map.models[i].dispMeshes.size() == 1);
+		// a model with its own lightmap atlas can be streamed with it, lightmap textures follow the map textures
+		if (map.models[i].lightmap != -1)
+		{
+			nodes[modelNodeId]["extras"]["lightmapTexture"] = (int)map.textures.size() + map.models[i].lightmap;
+			if (map.models[i].lightmapPages > 1)
+				nodes[modelNodeId]["extras"]["lightmapPages"] = map.models[i].lightmapPages;
+		}
+
+		bool singleMesh = (map.models[i].meshes.size() + map.models[i].dispMeshes.size() + map.models[i].portalMeshes.size() == 1);
 
 		if (singleMesh)
 		{
@@ -57,29 +151,37 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 				nodes[modelNodeId]["translation"] = { p.x, p.y, p.z };
 		}
 
-		auto writeMesh = [&](json &mesh, const Map::mesh_t &part, size_t vertsOffset, size_t vertSize)
+		auto writeMesh = [&](json &mesh, const Map::mesh_t &part, int kind)
 		{
-			bufferViews[bufferViewId + 0] = { {"buffer", 0}, {"byteOffset", indsBufferOffset + part.offset * indSize}, {"byteLength", part.count * indSize}, {"target", ELEMENT_ARRAY_BUFFER} };
-			bufferViews[bufferViewId + 1] = { {"buffer", 0}, {"byteOffset", vertsOffset + part.vertOffset * vertSize}, {"byteLength", part.vertCount * vertSize},{"byteStride", vertSize}, {"target", ARRAY_BUFFER} };
+			const slice_t &slice = *meshSlices[&part];
+			const size_t vertSize = vertexSize(kind);
+			bufferViews[bufferViewId + 0] = { {"buffer", part.buffer}, {"byteOffset", slice.indByteOffset}, {"byteLength", part.count * indSize}, {"target", ELEMENT_ARRAY_BUFFER} };
+			bufferViews[bufferViewId + 1] = { {"buffer", part.buffer}, {"byteOffset", slice.vertByteOffset}, {"byteLength", part.vertCount * vertSize},{"byteStride", vertSize}, {"target", ARRAY_BUFFER} };
 			vec3_t bmin{ FLT_MAX, FLT_MAX, FLT_MAX };
 			vec3_t bmax{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
-			for (int j = 0; j < part.vertCount; j++)
-			{
-				vec3_t v = (vertsOffset == 0) ? map.vertices[part.vertOffset + j].pos : map.dispVertices[part.vertOffset + j].pos;
-				bmin.x = fmin(bmin.x, v.x);
-				bmin.y = fmin(bmin.y, v.y);
-				bmin.z = fmin(bmin.z, v.z);
-				bmax.x = fmax(bmax.x, v.x);
-				bmax.y = fmax(bmax.y, v.y);
-				bmax.z = fmax(bmax.z, v.z);
-			}
+			if (kind == MESH_DISPLACEMENTS)
+				kernels().bounds(&map.dispVertices[part.vertOffset].pos, part.vertCount, sizeof(Map::dispVert_t), &bmin.x, &bmax.x);
+			else if (kind == MESH_PORTALS)
+				kernels().bounds(&map.portalVertices[part.vertOffset], part.vertCount, sizeof(vec3_t), &bmin.x, &bmax.x);
+			else
+				kernels().bounds(&map.vertices[part.vertOffset].pos, part.vertCount, sizeof(Map::vert_t), &bmin.x, &bmax.x);
 			modelAccessorId = accessorId;
 			accessors[accessorId + 0] = { {"bufferView",bufferViewId + 1},{"byteOffset",0},{"componentType",FLOAT},{"count",part.vertCount},{"type","VEC3"}, {"min",{bmin.x, bmin.y, bmin.z}}, {"max",{bmax.x, bmax.y, bmax.z}} };
+			if (kind == MESH_PORTALS)
+			{
+				// positions only, portals are never drawn
+				accessorId++;
+				mesh["primitives"][0] = { {"attributes", {{"POSITION",modelAccessorId + 0}}}, {"indices", accessorId} };
+				accessors[accessorId] = { {"bufferView", bufferViewId}, { "byteOffset", 0 }, { "componentType", indType }, { "count", part.count }, { "type","SCALAR" } };
+				accessorId++;
+				bufferViewId += 2;
+				return;
+			}
 			accessors[accessorId + 1] = { {"bufferView",bufferViewId + 1},{"byteOffset",12},{"componentType",FLOAT},{"count",part.vertCount},{"type","VEC3"} };
 			accessors[accessorId + 2] = { {"bufferView",bufferViewId + 1},{"byteOffset",24},{"componentType",FLOAT},{"count",part.vertCount},{"type","VEC2"} };
 			accessors[accessorId + 3] = { {"bufferView",bufferViewId + 1},{"byteOffset",32},{"componentType",FLOAT},{"count",part.vertCount},{"type","VEC2"} };
 			accessorId += 4;
-			if (vertsOffset != 0)
+			if (kind == MESH_DISPLACEMENTS)
 			{
 				accessors[accessorId] = { {"bufferView",bufferViewId + 1},{"byteOffset",40},{"componentType",FLOAT},{"count",part.vertCount},{"type","VEC4"} };
 				accessorId++;
@@ -90,9 +192,9 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 				mesh["primitives"][j] = {
 					{"attributes", {{"POSITION",modelAccessorId + 0}, {"NORMAL",modelAccessorId + 1}, {"TEXCOORD_0",modelAccessorId + 2}, {"TEXCOORD_1",modelAccessorId + 3}}},
 					{"indices", accessorId},
-					{"material", part.submeshes[j].material}
+					{"material", materialIndex(part.submeshes[j].material, part.submeshes[j].lightmap)}
 				};
-				if(vertsOffset != 0)
+				if (kind == MESH_DISPLACEMENTS)
 				{
 					mesh["primitives"][j]["attributes"]["COLOR_0"] = modelAccessorId + 4;
 				}
@@ -102,53 +204,38 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 			bufferViewId += 2;
 		};
 
-		for (int mmi = 0; mmi < map.models[i].meshes.size(); mmi++)
+		auto writeParts = [&](const std::vector<Map::mesh_t> &parts, int kind, const char *suffix)
 		{
-			const Map::mesh_t &part = map.models[i].meshes[mmi];
-			if (part.vertCount == 0)
-				continue;
-
-			meshes[meshId] = { {"primitives",json::array()} };
-			if (!singleMesh)
+			for (int mmi = 0; mmi < parts.size(); mmi++)
 			{
-				std::string meshName = name + "_model" + std::to_string(i) + "_mesh" + std::to_string(mmi);
-				nodes[nodeId] = { {"name", part.name.empty() ? meshName : part.name}, {"mesh", meshId} };
-				nodes[modelNodeId]["children"].push_back(nodeId);
-				nodeId++;
-				meshes[meshId]["name"] = meshName;
-			}
-			else
-			{
-				meshes[meshId]["name"] = name + "_model" + std::to_string(i) + "_mesh";
-			}
+				const Map::mesh_t &part = parts[mmi];
+				if (part.vertCount == 0)
+					continue;
 
-			writeMesh(meshes[meshId], part, vertBufferOffset, sizeof(map.vertices[0]));
-			meshId++;
-		}
-
-		for (int dmi = 0; dmi < map.models[i].dispMeshes.size(); dmi++)
-		{
-			const Map::mesh_t &part = map.models[i].dispMeshes[dmi];
-			if (part.vertCount == 0)
-				continue;
+				meshes[meshId] = { {"primitives",json::array()} };
+				if (!singleMesh)
+				{
+					std::string meshName = name + "_model" + std::to_string(i) + suffix + std::to_string(mmi);
+					nodes[nodeId] = { {"name", part.name.empty() ? meshName : part.name}, {"mesh", meshId} };
+					nodes[modelNodeId]["children"].push_back(nodeId);
+					meshNodes[&part] = nodeId;
+					nodeId++;
+					meshes[meshId]["name"] = meshName;
+				}
+				else
+				{
+					meshes[meshId]["name"] = name + "_model" + std::to_string(i) + suffix;
+					meshNodes[&part] = modelNodeId;
+				}
 
-			meshes[meshId] = { {"primitives",json::array()} };
-			if (!singleMesh)
-			{
-				std::string meshName = name + "_model" + std::to_string(i) + "_dispMesh" + std::to_string(dmi);
-				nodes[nodeId] = { {"name", part.name.empty() ? meshName : part.name}, {"mesh", meshId} };
-				nodes[modelNodeId]["children"].push_back(nodeId);
-				nodeId++;
-				meshes[meshId]["name"] = meshName;
-			}
-			else
-			{
-				meshes[meshId]["name"] = name + "_model" + std::to_string(i) + "_dispMesh";
+				writeMesh(meshes[meshId], part, kind);
+				meshId++;
 			}
+		};
 
-			writeMesh(meshes[meshId], part, dispVertBufferOffset, sizeof(map.dispVertices[0]));
-			meshId++;
-		}
+		writeParts(map.models[i].meshes, MESH_SURFACES, "_mesh");
+		writeParts(map.models[i].dispMeshes, MESH_DISPLACEMENTS, "_dispMesh");
+		writeParts(map.models[i].portalMeshes, MESH_PORTALS, "_portalMesh");
 	}
 
 	auto &textures = j["textures"];
@@ -165,11 +252,15 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 		textures[i] = { {"source", i} };
 	}
 
+	std::vector<std::string> lightmaps = map.lightmaps;
+	if (lightmaps.empty())
+		lightmaps.push_back(name + "_lightmap0.png");
+
 	auto &materials = j["materials"];
-	for (int i = 0; i < map.materials.size(); i++)
+	static const char *lightmapEncodings[] = { "srgb", "rgbm", "rgbe", "half" };
+	auto writeMaterial = [&](int i, const Map::material_t &mat, const std::string &matName, int lightmap)
 	{
-		const auto &mat = map.materials[i];
-		materials[i] = {{"name", mat.name}};
+		materials[i] = {{"name", matName}};
 
 		if (mat.alphaMask)
 			materials[i]["alphaMode"] = "MASK";
@@ -182,39 +273,93 @@ bool exportMap(const std::string &name, Map &map, bool verbose)
 			materials[i]["pbrMetallicRoughness"]["baseColorTexture"] = { {"index", mat.texture} };
 		}
 		if (mat.lightmapped)
-			materials[i]["extensions"] = { {"EXT_materials_lightmap",{{"lightmapTexture", { {"index", lmapTexIndex}, {"texCoord", 1} }}}} };
+		{
+			materials[i]["extensions"] = { {"EXT_materials_lightmap",{{"lightmapTexture", { {"index", lmapTexIndex + lightmap}, {"texCoord", 1} }}}} };
+			if (map.lightmapHdr != eLightmapHdr::NONE)
+				materials[i]["extensions"]["EXT_materials_lightmap"]["encoding"] = lightmapEncodings[(int)map.lightmapHdr];
+		}
+	};
+
+	for (int i = 0; i < map.materials.size(); i++)
+		writeMaterial(i, map.materials[i], map.materials[i].name, 0);
+
+	for (const auto &variant : materialVariants)
+	{
+		const auto &mat = map.materials[variant.first.first];
+		writeMaterial(variant.second, mat, mat.name + "_lightmap" + std::to_string(variant.first.second), variant.first.second);
 	}
 
-	images[lmapTexIndex] = { {"uri", name + "_lightmap0.png"} };
-	textures[lmapTexIndex] = { {"source", lmapTexIndex} };
+	for (int i = 0; i < lightmaps.size(); i++)
+	{
+		images[lmapTexIndex + i] = { {"uri", lightmaps[i]} };
+		if (map.lightmapHdr == eLightmapHdr::HALF)
+			images[lmapTexIndex + i]["mimeType"] = "image/ktx2";
+		textures[lmapTexIndex + i] = { {"source", lmapTexIndex + i} };
+	}
 
-	size_t vertsLen = map.vertices.size() * sizeof(map.vertices[0]) + map.dispVertices.size() * sizeof(map.dispVertices[0]);
-	size_t indsLen = 0;
+	// light style atlases hold only the blocks that use the style, a luxel at main atlas position p inside
+	// block (x, y, w, h) is at p - (x, y) + (styleX, styleY) in the style atlas
+	const int styleTexIndex = lmapTexIndex + (int)lightmaps.size();
+	for (int i = 0; i < map.lightstyles.size(); i++)
+	{
+		const auto &ls = map.lightstyles[i];
+		images[styleTexIndex + i] = { {"uri", ls.image} };
+		textures[styleTexIndex + i] = { {"source", styleTexIndex + i} };
+		j["extras"]["lightstyles"][i] = { {"style", ls.style}, {"texture", styleTexIndex + i}, {"width", ls.width}, {"height", ls.height},
+			{"blockFormat", "page,x,y,w,h,styleX,styleY"}, {"blocks", ls.blocks} };
+	}
 
-	std::string bufferName = name + ".bin";
+	for (int b = 0; b < bufferCount; b++)
+	{
+		std::string bufferName = name + (b ? "_" + map.bufferNames[b] : std::string()) + ".bin";
 
-	if (verbose)
-		printf("Writing: %s\n", bufferName.c_str());
-	std::ofstream bufferFile(bufferName, std::ios_base::binary);
-	if(map.vertices.size())
-		bufferFile.write((char *)&map.vertices[0], map.vertices.size() * sizeof(map.vertices[0]));
+		if (verbose)
+			printf("Writing: %s\n", bufferName.c_str());
+		std::ofstream bufferFile(bufferName, std::ios_base::binary);
+		for (const auto &slice : vertSlices[b])
+		{
+			const size_t len = slice.mesh->vertCount * vertexSize(slice.kind);
+			if (slice.kind == MESH_DISPLACEMENTS)
+				bufferFile.write((char *)&map.dispVertices[slice.mesh->vertOffset], len);
+			else if (slice.kind == MESH_PORTALS)
+				bufferFile.write((char *)&map.portalVertices[slice.mesh->vertOffset], len);
+			else
+				bufferFile.write((char *)&map.vertices[slice.mesh->vertOffset], len);
+		}
 
-	if(map.dispVertices.size())
-		bufferFile.write((char *)&map.dispVertices[0], map.dispVertices.size() * sizeof(map.dispVertices[0]));
+		for (const auto *slice : indSlices[b])
+		{
+			if (map.indices16.size())
+				bufferFile.write((char *)&map.indices16[slice->mesh->offset], slice->mesh->count * indSize);
+			else
+				bufferFile.write((char *)&map.indices32[slice->mesh->offset], slice->mesh->count * indSize);
+		}
+		bufferFile.close();
 
-	if (map.indices16.size())
-	{
-		indsLen = map.indices16.size() * sizeof(map.indices16[0]);
-		bufferFile.write((char *)&map.indices16[0], indsLen);
+		j["buffers"][b] = { {"uri", bufferName}, {"byteLength", bufferLengths[b]} };
 	}
-	else
+
+	// area graph for portal culling and streaming, 'buffer' is -1 for areas without own geometry
+	if (map.areas.size())
 	{
-		indsLen = map.indices32.size() * sizeof(map.indices32[0]);
-		bufferFile.write((char *)&map.indices32[0], indsLen);
+		auto &areas = j["extras"]["areas"];
+		for (int i = 0; i < map.areas.size(); i++)
+		{
+			const auto &area = map.areas[i];
+			areas[i] = { {"buffer", area.buffer}, {"portals", json::array()} };
+			if (area.lightmap != -1)
+				areas[i]["lightmapTexture"] = lmapTexIndex + area.lightmap;
+			if (area.lightmapPages > 1)
+				areas[i]["lightmapPages"] = area.lightmapPages;
+			for (const auto &portal : area.portals)
+			{
+				json p = { {"otherArea", portal.otherArea}, {"portalKey", portal.portalKey} };
+				if (portal.mesh != -1)
+					p["node"] = meshNodes[&map.models[0].portalMeshes[portal.mesh]];
+				areas[i]["portals"].push_back(p);
+			}
+		}
 	}
-	bufferFile.close();
-
-	j["buffers"] = { { {"uri", bufferName}, {"byteLength", vertsLen + indsLen} } };
 
 	if (verbose)
 		printf("Writing: %s.gltf\n", name.c_str());
@@ -7,8 +7,16 @@
 #include "lightmap.h"
 #include "wad.h"
 #include "parser.h"
+#include "face_merge.h"
+#include "face_batch.h"
+#include "parallel.h"
+#include "face_uv.h"
+#include "cpu.h"
 #include <cfloat>
+#include <climits>
 #include <cstring>
+#include <algorithm>
+#include <tuple>
 
 #ifdef __linux__
 #include <sys/stat.h>
@@ -17,8 +25,19 @@
 #define strnicmp strncasecmp
 #elif _MSC_VER
 #define strnicmp _strnicmp
+#define strcasecmp _stricmp
 #endif
 
+// brush entities which never move, their geometry can go into the world
+static const char *staticBrushClasses[] = {
+	"func_wall",
+	"func_illusionary",
+	"func_detail",
+	"func_detail_illusionary",
+	"func_lod",
+	"func_brush"
+};
+
 bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 {
 	using namespace hlbsp;
@@ -43,6 +62,13 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 		return false;
 	}
 
+	if (config->areaBuffers)
+		printf("Warning: '-area_buffers' is supported only for VBSP maps\n");
+	if (config->areaPortals)
+		printf("Warning: '-area_portals' is supported only for VBSP maps\n");
+	if (config->lightmapHdr != eLightmapHdr::NONE)
+		printf("Warning: '-lm_hdr' is supported only for VBSP maps\n");
+
 	if (header.version == XTBSP_VERSION)
 		fread(&header31, sizeof(header31), 1, f);
 
@@ -51,17 +77,17 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 	if (headerExtra.id != IDEXTRAHEADER || headerExtra.version != EXTRA_VERSION)
 		headerExtra.id = 0; // no extra header
 
-	std::vector<char> entitiesText;
-	std::vector<dplane_t> planes;
-	std::vector<vec3_t> bspVertices;
-	std::vector<dmodel_t> bspModels;
-	std::vector<dfaceinfo_t> faceInfos;
-	std::vector<dface_t> faces;
-	std::vector<int> surfedges;
-	std::vector<dedge_t> edges;
-	std::vector<dtexinfo_t> texinfos;
-	std::vector<uint8_t> lightmapPixels;
-	std::vector<uint8_t> lightmapVecs;
+	std::pmr::vector<char> entitiesText(arena);
+	std::pmr::vector<dplane_t> planes(arena);
+	std::pmr::vector<vec3_t> bspVertices(arena);
+	std::pmr::vector<dmodel_t> bspModels(arena);
+	std::pmr::vector<dfaceinfo_t> faceInfos(arena);
+	std::pmr::vector<dface_t> faces(arena);
+	std::pmr::vector<int> surfedges(arena);
+	std::pmr::vector<dedge_t> edges(arena);
+	std::pmr::vector<dtexinfo_t> texinfos(arena);
+	std::pmr::vector<uint8_t> lightmapPixels(arena);
+	std::pmr::vector<uint8_t> lightmapVecs(arena);
 
 #define READ_LUMP(to, lump) \
 	to.resize(lump.filelen / sizeof(to[0])); \
@@ -94,8 +120,46 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 
 	parseEntities(&entitiesText[0], entitiesText.size());
 
-	std::vector<WadFile> wads;
-	if (config->allTextures)
+	// -lm_only reuses the lightmap layout of the last conversion while the geometry, the light styles of faces
+	// and the lightmap options stay the same. Only the texture names are needed to check that
+	std::vector<std::shared_ptr<const WadFile> > wads;
+	LightmapLayout layout;
+	const std::string layoutPath = std::string(name) + ".lmlayout";
+	uint64_t layoutKey = 0;
+	bool layoutCached = false;
+	if (config->lightmapOnly && lightmapPixels.size())
+	{
+		hlbsp_loadTextures(f, header.lumps[LUMP_TEXTURES].fileofs, header.lumps[LUMP_TEXTURES].filelen, wads, false, true);
+		layoutKey = LightmapLayout::hash(&header.version, sizeof(header.version));
+		layoutKey = LightmapLayout::hash(bspVertices.data(), bspVertices.size() * sizeof(bspVertices[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(edges.data(), edges.size() * sizeof(edges[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(surfedges.data(), surfedges.size() * sizeof(surfedges[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(texinfos.data(), texinfos.size() * sizeof(texinfos[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(faceInfos.data(), faceInfos.size() * sizeof(faceInfos[0]), layoutKey);
+		for (const auto &face : faces)
+		{
+			const int32_t fields[] = { face.planenum, face.side, face.firstedge, face.numedges, face.texinfo, face.lightofs != -1 };
+			layoutKey = LightmapLayout::hash(fields, sizeof(fields), layoutKey);
+			layoutKey = LightmapLayout::hash(face.styles, sizeof(face.styles), layoutKey);
+		}
+		for (int mi = 0; mi < bspModels.size(); mi++)
+		{
+			// static models stay in the world atlas with -lm_models
+			const int32_t fields[] = { bspModels[mi].firstface, bspModels[mi].numfaces, models[mi].isStatic };
+			layoutKey = LightmapLayout::hash(fields, sizeof(fields), layoutKey);
+		}
+		for (const auto &texture : textures)
+			layoutKey = LightmapLayout::hash(texture.name.c_str(), texture.name.size() + 1, layoutKey);
+		layoutKey = LightmapLayout::hashOptions(*config, layoutKey);
+
+		layoutCached = layout.load(layoutPath, layoutKey, faces.size());
+		if (!layoutCached)
+			printf("Lightmap layout %s is missing or outdated, the map will be converted fully\n", layoutPath.c_str());
+		else if (config->verbose)
+			printf("Lightmap layout is taken from %s\n", layoutPath.c_str());
+	}
+
+	if (config->allTextures && !layoutCached)
 	{
 		std::string basePath;
 		if (config->gamePath.size() && config->gamePath.find("valve") == std::string::npos)
@@ -111,7 +175,7 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 			struct stat statBuffer;
 			if (!stat(wadPath.c_str(), &statBuffer))
 			{
-				wads[i].load(wadPath.c_str());
+				wads[i] = WadCache::shared().open(wadPath);
 				continue;
 			}
 
@@ -120,7 +184,7 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 				wadPath = basePath + wadNames[i];
 				if (!stat(wadPath.c_str(), &statBuffer))
 				{
-					wads[i].load(wadPath.c_str());
+					wads[i] = WadCache::shared().open(wadPath);
 					continue;
 				}
 			}
@@ -129,7 +193,8 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 		}
 	}
 
-	hlbsp_loadTextures(f, header.lumps[LUMP_TEXTURES].fileofs, header.lumps[LUMP_TEXTURES].filelen, wads, config->verbose);
+	if (!layoutCached)
+		hlbsp_loadTextures(f, header.lumps[LUMP_TEXTURES].fileofs, header.lumps[LUMP_TEXTURES].filelen, wads, config->verbose);
 
 	fclose(f);
 
@@ -147,17 +212,18 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 		materials[i].lightmapped = true;
 	}
 
-	std::vector<Lightmap::RectI> lmRects(faces.size());
-	std::vector<vec2i_t> lmMins(faces.size());
-
-	Lightmap lightmap(config->lightmapSize, lightmapVecs.size() != 0);
+	std::pmr::vector<Lightmap::RectI> lmRects(faces.size(), arena);
+	std::pmr::vector<vec2i_t> lmMins(faces.size(), arena);
+	// luxel density of every face relative to the bsp, and the block of bsp luxels it was scaled from
+	std::pmr::vector<float> lmScales(faces.size(), 1.0f, arena);
+	std::pmr::vector<Lightmap::RectI> lmSources(faces.size(), arena);
 
 	int numedges = (int)edges.size();
-	std::vector<std::map<int, std::vector<int> > > modelMaterialFaces(bspModels.size());
+	std::pmr::vector<float> cornersX(arena), cornersY(arena), cornersZ(arena);
+	FaceBatches batches(arena);
 	for (int mi = 0; mi < bspModels.size(); mi++)
 	{
 		const auto &m = bspModels[mi];
-		// sort faces by texture and batch into a single mesh
 
 		for (int fi = m.firstface; fi < m.firstface + m.numfaces; fi++)
 		{
@@ -168,7 +234,7 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 
 			if (config->skipSky && !strnicmp(textures[ti.miptex].name.data(), "sky", textures[ti.miptex].name.size()))
 				continue;
-			modelMaterialFaces[mi][ti.miptex].push_back(fi);
+			batches.add(mi, 0, 0, ti.miptex, fi);
 
 			// lightmap calculations
 			if (lightmapPixels.empty() || f.lightofs == -1 || f.styles[0] == 255)
@@ -178,8 +244,9 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 			if (ti.faceInfo >= 0 && ti.faceInfo < faceInfos.size())
 				sampleSize = faceInfos[ti.faceInfo].textureStep;
 
-			vec2_t min_uv{ FLT_MAX, FLT_MAX };
-			vec2_t max_uv{ -FLT_MAX, -FLT_MAX };
+			cornersX.resize(f.numedges);
+			cornersY.resize(f.numedges);
+			cornersZ.resize(f.numedges);
 			for (int j = 0; j < f.numedges; j++)
 			{
 				int e = surfedges[f.firstedge + j];
@@ -193,55 +260,685 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 					fprintf(stderr, "Error: model %d face %d bad vertex index %d\n", mi, fi, vi);
 					return false;
 				}
-				const vec3_t &v = bspVertices[vi];
-				vec2_t uv = { static_cast<float>(v.dot_d(ti.texVecS)) + ti.texOffS, static_cast<float>(v.dot(ti.texVecT)) + ti.texOffT };
-				min_uv.x = fminf(min_uv.x, uv.x);
-				max_uv.x = fmaxf(max_uv.x, uv.x);
-				min_uv.y = fminf(min_uv.y, uv.y);
-				max_uv.y = fmaxf(max_uv.y, uv.y);
+				cornersX[j] = bspVertices[vi].x;
+				cornersY[j] = bspVertices[vi].y;
+				cornersZ[j] = bspVertices[vi].z;
 			}
 
+			vec2_t min_uv{ FLT_MAX, FLT_MAX };
+			vec2_t max_uv{ -FLT_MAX, -FLT_MAX };
+			faceuv::texBounds(cornersX.data(), cornersY.data(), cornersZ.data(), f.numedges, ti.texVecS, ti.texOffS, ti.texVecT, ti.texOffT, min_uv, max_uv);
+
 			lmMins[fi] = { int(floor(min_uv.x / sampleSize)), int(floor(min_uv.y / sampleSize)) };
 			rect.w = ceil(max_uv.x / sampleSize) - lmMins[fi].x + 1;
 			rect.h = ceil(max_uv.y / sampleSize) - lmMins[fi].y + 1;
+
+			// a scaled face gets a coarser luxel grid in texture space, the density doubles back
+			// until the face keeps the minimum size
+			if (config->lightmapScale < 1)
+			{
+				lmSources[fi] = { lmMins[fi].x, lmMins[fi].y, rect.w, rect.h };
+				const int minW = std::min(config->lightmapScaleMin, rect.w);
+				const int minH = std::min(config->lightmapScaleMin, rect.h);
+				float scale = config->lightmapScale;
+				while (true)
+				{
+					const float step = sampleSize / scale;
+					lmMins[fi] = { int(floor(min_uv.x / step)), int(floor(min_uv.y / step)) };
+					rect.w = ceil(max_uv.x / step) - lmMins[fi].x + 1;
+					rect.h = ceil(max_uv.y / step) - lmMins[fi].y + 1;
+					if (scale >= 1 || (rect.w >= minW && rect.h >= minH))
+						break;
+					scale = std::min(scale * 2, 1.0f);
+				}
+				lmScales[fi] = scale;
+			}
 		}
 	}
 
+	// bsp luxels are filtered down to the scaled face blocks, the lighting lumps are rebuilt with new offsets
+	if (config->lightmapScale < 1 && lightmapPixels.size())
+	{
+		std::pmr::vector<int> scaledOfs(faces.size(), -1, arena);
+		size_t scaledSize = 0;
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			if (lmRects[fi].w * lmRects[fi].h == 0)
+				continue;
+			int styles = 0;
+			while (styles < LM_STYLES && faces[fi].styles[styles] != 255)
+				styles++;
+			scaledOfs[fi] = (int)scaledSize;
+			scaledSize += (size_t)styles * lmRects[fi].w * lmRects[fi].h * 3;
+		}
+
+		std::pmr::vector<uint8_t> scaledPixels(scaledSize, arena);
+		std::pmr::vector<uint8_t> scaledVecs(lightmapVecs.size() ? scaledSize : 0, arena);
+		parallelFor((int)faces.size(), config->threads, [&](int fi)
+		{
+			if (scaledOfs[fi] == -1)
+				return;
+			const Lightmap::RectI &src = lmSources[fi];
+			const Lightmap::RectI &rect = lmRects[fi];
+			// scaled luxel j lies at (mins + j) / scale in bsp luxels
+			const float step = 1.0f / lmScales[fi];
+			const float x0 = lmMins[fi].x * step - src.x;
+			const float y0 = lmMins[fi].y * step - src.y;
+			for (int s = 0; s < LM_STYLES && faces[fi].styles[s] != 255; s++)
+			{
+				const size_t from = faces[fi].lightofs + (size_t)s * src.w * src.h * 3;
+				const size_t to = scaledOfs[fi] + (size_t)s * rect.w * rect.h * 3;
+				Lightmap::resample(&lightmapPixels[from], src.w, src.h, &scaledPixels[to], rect.w, rect.h, x0, step, y0, step, config->lightmapFilter, false);
+				if (lightmapVecs.size())
+					Lightmap::resample(&lightmapVecs[from], src.w, src.h, &scaledVecs[to], rect.w, rect.h, x0, step, y0, step, config->lightmapFilter, false);
+			}
+		}, 16);
+
+		if (config->verbose)
+			printf("Lightmap luxels scaled from %zd to %zd bytes\n", lightmapPixels.size(), scaledPixels.size());
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			if (scaledOfs[fi] != -1)
+				faces[fi].lightofs = scaledOfs[fi];
+		}
+		lightmapPixels.swap(scaledPixels);
+		lightmapVecs.swap(scaledVecs);
+	}
+	// sort faces by model and texture, every run becomes a submesh
+	batches.sort();
+
+	// join coplanar neighbours with the same texinfo and lightstyles
+	std::vector<FaceMerger::polygon_t> mergedPolys;
+	std::pmr::vector<int> facePolys(faces.size(), -1, arena);
+	std::pmr::vector<vec2i_t> polyLmMins(arena);
+	std::pmr::vector<Lightmap::RectI> faceLmSizes(arena);
+	if (config->mergeFaces)
+	{
+		FaceMerger merger(bspVertices.data());
+		int mergedCount = 0;
+
+		// lightmap extents of every face, merged polygons must fit in one block
+		std::pmr::vector<FaceMerger::luxelBounds_t> faceLuxels(faces.size(), arena);
+		for (size_t fi = 0; fi < faces.size(); fi++)
+			faceLuxels[fi] = { { lmMins[fi].x, lmMins[fi].y }, { lmMins[fi].x + lmRects[fi].w, lmMins[fi].y + lmRects[fi].h } };
+		auto acceptMerge = [&](const FaceMerger::polygon_t &poly)
+		{
+			return FaceMerger::acceptLuxelBounds(poly, faceLuxels.data());
+		};
+
+		// every model and material run is replaced with the first faces of its polygons
+		std::pmr::vector<FaceBatches::entry_t> mergedEntries(arena);
+		std::pmr::vector<int> polyFaces(arena);
+		for (size_t begin = 0; begin < batches.entries.size();)
+		{
+			const size_t end = batches.runEnd(begin, FaceBatches::MATERIAL_BITS);
+			std::map<std::tuple<int, int, int, bool, uint32_t, float>, std::vector<FaceMerger::polygon_t> > groups;
+			for (size_t ei = begin; ei < end; ei++)
+			{
+				const int fi = batches.entries[ei].face;
+				const auto &f = faces[fi];
+				uint32_t styles;
+				memcpy(&styles, f.styles, sizeof(styles));
+				FaceMerger::polygon_t poly;
+				poly.faces.push_back(fi);
+				for (int j = 0; j < f.numedges; j++)
+				{
+					int e = surfedges[f.firstedge + j];
+					poly.corners.push_back({ fi, j, edges[abs(e)].v[(e > 0 ? 0 : 1)] });
+				}
+				groups[{f.planenum, f.side, f.texinfo, lmRects[fi].w * lmRects[fi].h != 0, styles, lmScales[fi]}].push_back(std::move(poly));
+			}
+
+			polyFaces.clear();
+			for (auto &group : groups)
+			{
+				mergedCount += merger.merge(group.second, acceptMerge);
+				for (auto &poly : group.second)
+				{
+					polyFaces.push_back(poly.faces[0]);
+					if (poly.faces.size() == 1)
+						continue;
+					for (int fi : poly.faces)
+						facePolys[fi] = (int)mergedPolys.size();
+					mergedPolys.push_back(std::move(poly));
+				}
+			}
+			std::sort(polyFaces.begin(), polyFaces.end());
+			for (int fi : polyFaces)
+				mergedEntries.push_back({ batches.entries[begin].key, fi });
+			begin = end;
+		}
+		batches.entries.swap(mergedEntries);
+
+		// pack a single block per polygon, sized to cover all of its faces
+		faceLmSizes = lmRects;
+		FaceMerger::fitLightmapRects(mergedPolys, faceLuxels.data(), lmRects, polyLmMins);
+
+		if (config->verbose)
+			printf("Merged %d faces into %d polygons\n", mergedCount + (int)mergedPolys.size(), (int)mergedPolys.size());
+	}
+
+	// with -lm_models every brush entity that can move gets its own atlas, or shares one with the other small
+	// models. The world and the models baked into it stay in the first atlas
+	std::pmr::vector<int> faceAtlases(faces.size(), 0, arena);
+	std::vector<std::string> atlasNames(1, name);
+	if (config->lightmapModelMin >= 0 && lightmapPixels.size())
+	{
+		int sharedAtlas = -1;
+		for (int mi = 1; mi < bspModels.size(); mi++)
+		{
+			if (config->staticBatching && models[mi].isStatic)
+				continue;
+			const auto &m = bspModels[mi];
+			int64_t luxels = 0;
+			for (int fi = m.firstface; fi < m.firstface + m.numfaces; fi++)
+				luxels += (int64_t)lmRects[fi].w * lmRects[fi].h;
+			if (!luxels)
+				continue;
+			if (luxels < config->lightmapModelMin && sharedAtlas == -1)
+			{
+				sharedAtlas = (int)atlasNames.size();
+				atlasNames.push_back(std::string(name) + "_models");
+			}
+			int atlas = sharedAtlas;
+			if (luxels >= config->lightmapModelMin)
+			{
+				atlas = (int)atlasNames.size();
+				atlasNames.push_back(std::string(name) + "_model" + std::to_string(mi));
+			}
+			for (int fi = m.firstface; fi < m.firstface + m.numfaces; fi++)
+				faceAtlases[fi] = atlas;
+			models[mi].lightmap = atlas;
+		}
+		if (config->verbose)
+			printf("Brush models take %d lightmap atlases\n", (int)atlasNames.size() - 1);
+	}
+
+	Lightmap atlasProto(config->lightmapSize, lightmapVecs.size() != 0);
+	atlasProto.packer = config->lightmapPacker;
+	atlasProto.allowRotation = config->lightmapRotate;
+	atlasProto.padding = config->lightmapPadding;
+	std::vector<Lightmap> atlases(atlasNames.size(), atlasProto);
+	// atlas pages are consecutive lightmap images
+	std::pmr::vector<int> atlasFirstImage(atlases.size(), 0, arena);
+	auto faceImage = [&](int fi) { return (lmRects[fi].page < 0) ? -1 : atlasFirstImage[faceAtlases[fi]] + lmRects[fi].page; };
+
+	// atlases and light style atlases are written after the geometry, or straight away with a cached layout
+	auto saveLightmaps = [&]()
+	{
+		if (lightmapPixels.empty())
+			return;
+		for (int li = 0; li < atlases.size(); li++)
+		{
+			atlases[li].dilate(config->threads);
+			std::vector<std::string> pages = atlases[li].uploadBlock(atlasNames[li], config->verbose);
+			lightmaps.insert(lightmaps.end(), pages.begin(), pages.end());
+		}
+
+		std::set<int> lstyles;
+		for (int i = 0; i < faces.size(); i++)
+		{
+			const dface_t &f = faces[i];
+			for (int j = 0; j < LM_STYLES && f.styles[j] != 255; j++)
+			{
+				if (f.styles[j] != 0 && (config->lstylesAll || config->lstylesMerge || f.styles[j] == config->lstyle))
+				{
+					lstyles.insert(f.styles[j]);
+					if (config->lstylesMerge)
+						break;
+				}
+			}
+
+			if (config->lstylesMerge && lstyles.size())
+				break;
+		}
+
+		// the merged atlas sums all styles of a face and keeps the main layout. Every other style gets a compact
+		// atlas of just the lightmap blocks that use it, blocks are the faces or the merged polygons
+		std::pmr::vector<int> faceBlocks(faces.size(), -1, arena);
+		std::pmr::vector<Lightmap::RectI> blocks(arena);
+		std::pmr::vector<int> polyBlocks(mergedPolys.size(), -1, arena);
+		for (int i = 0; i < faces.size(); i++)
+		{
+			const Lightmap::RectI &rect = lmRects[i];
+			if (rect.w * rect.h == 0 || faces[i].lightofs < 0)
+				continue;
+			int &polyBlock = (facePolys[i] != -1) ? polyBlocks[facePolys[i]] : faceBlocks[i];
+			if (polyBlock == -1)
+			{
+				polyBlock = (int)blocks.size();
+				blocks.push_back(rect);
+				blocks.back().id = i;	// styles are the same for all faces of a block
+				blocks.back().page = faceImage(i);
+			}
+			else
+			{
+				Lightmap::RectI &block = blocks[polyBlock];
+				int x1 = std::max(block.x + block.w, rect.x + rect.w);
+				int y1 = std::max(block.y + block.h, rect.y + rect.h);
+				block.x = std::min(block.x, rect.x);
+				block.y = std::min(block.y, rect.y);
+				block.w = x1 - block.x;
+				block.h = y1 - block.y;
+			}
+			faceBlocks[i] = polyBlock;
+		}
+
+		// first atlas of every style, the merged atlas has a page per lightmap image
+		int styleAtlas[256];
+		std::fill(std::begin(styleAtlas), std::end(styleAtlas), (config->lstylesMerge && lstyles.size()) ? 0 : -1);
+		std::vector<Texture> styleAtlases;
+		// per style, the rect of every block in its atlas pages
+		std::vector<std::vector<Lightmap::RectI> > styleBlocks(256);
+		int stylePages[256] = {};
+		if (config->lstylesMerge)
+		{
+			if (lstyles.size())
+			{
+				for (const Lightmap &atlas : atlases)
+				{
+					for (int p = 0; p < atlas.pageCount; p++)
+						styleAtlases.emplace_back(atlas.block_width, atlas.block_height, Texture::RGB8);
+				}
+			}
+		}
+		else
+		{
+			Lightmap packer(config->lightmapSize);
+			packer.packer = config->lightmapPacker;
+			packer.padding = config->lightmapPadding;
+			std::pmr::vector<Lightmap::RectI> rects(arena);
+			std::pmr::vector<int> rectBlocks(arena);
+			for (int style : lstyles)
+			{
+				rects.clear();
+				rectBlocks.clear();
+				for (int bi = 0; bi < blocks.size(); bi++)
+				{
+					const dface_t &f = faces[blocks[bi].id];
+					for (int s = 0; s < LM_STYLES && f.styles[s] != 255; s++)
+					{
+						if (f.styles[s] == style)
+						{
+							rects.push_back(blocks[bi]);
+							rectBlocks.push_back(bi);
+							break;
+						}
+					}
+				}
+				if (!rects.size())
+					continue;
+				packer.pack(rects, config->lightmapSize, config->verbose);
+
+				styleAtlas[style] = (int)styleAtlases.size();
+				stylePages[style] = packer.pageCount;
+				for (int p = 0; p < packer.pageCount; p++)
+					styleAtlases.emplace_back(packer.block_width, packer.block_height, Texture::RGB8);
+				styleBlocks[style].resize(blocks.size());
+				for (int ri = 0; ri < rects.size(); ri++)
+					styleBlocks[style][rectBlocks[ri]] = rects[ri];
+			}
+		}
+
+		// texels of every style atlas with luxels, the gutters are dilated from them
+		std::vector<std::vector<uint8_t> > styleCoverage(config->lightmapPadding ? styleAtlases.size() : 0);
+		for (int ai = 0; ai < styleCoverage.size(); ai++)
+			styleCoverage[ai].resize((size_t)styleAtlases[ai].width * styleAtlases[ai].height);
+
+		// one pass over the faces fills every style atlas. Faces of a merged polygon share edge luxels, so like in
+		// the main atlas the first face writes all of them in order and every face copies its luxels over
+		parallelFor(styleAtlases.size() ? (int)lmRects.size() : 0, config->threads, [&](int face)
+		{
+			const int pi = facePolys[face];
+			if (pi != -1 && mergedPolys[pi].faces[0] != face)
+				return;
+
+			thread_local std::vector<uint8_t> merged;
+			auto copyRect = [&](int ai, int x, int y, const Lightmap::RectI &rect, const uint8_t *src)
+			{
+				Texture &atlas = styleAtlases[ai];
+				if (styleCoverage.size())
+				{
+					for (int row = y; row < y + rect.h; row++)
+						memset(&styleCoverage[ai][(size_t)row * atlas.width + x], 1, rect.w);
+				}
+				uint8_t *dst = atlas.get(x, y);
+				if (!rect.rotated)
+				{
+					for (int row = 0; row < rect.h; row++)
+					{
+						memcpy(dst, src, rect.w * 3);
+						dst += atlas.width * 3;
+						src += rect.w * 3;
+					}
+				}
+				else
+				{
+					// luxel rows go down the atlas columns
+					for (int row = 0; row < rect.w; row++)
+					{
+						for (int col = 0; col < rect.h; col++, src += 3)
+							memcpy(dst + ((size_t)col * atlas.width + row) * 3, src, 3);
+					}
+				}
+			};
+			auto writeFace = [&](int i)
+			{
+				const dface_t &f = faces[i];
+				const Lightmap::RectI &rect = lmRects[i];
+				if (faceBlocks[i] == -1)
+					return;
+				const size_t styleSize = (size_t)rect.w * rect.h * 3;
+
+				// the merged atlas gets the saturated sum of all styles of the face
+				if (config->lstylesMerge)
+				{
+					const int page = faceImage(i);
+					if (page == -1)
+						return;
+					merged.assign(styleSize, 0);
+					for (int s = 0; s < LM_STYLES && f.styles[s] != 255; s++)
+						kernels().addSaturate(merged.data(), &lightmapPixels[f.lightofs + s * styleSize], styleSize);
+					copyRect(page, rect.x, rect.y, rect, merged.data());
+					return;
+				}
+
+				const Lightmap::RectI &block = blocks[faceBlocks[i]];
+				for (int s = 0; s < LM_STYLES && f.styles[s] != 255; s++)
+				{
+					const int ai = styleAtlas[f.styles[s]];
+					if (ai == -1)
+						continue;
+					const Lightmap::RectI &styleBlock = styleBlocks[f.styles[s]][faceBlocks[i]];
+					if (styleBlock.page == -1)
+						continue;
+					copyRect(ai + styleBlock.page, rect.x + styleBlock.x - block.x, rect.y + styleBlock.y - block.y, rect, &lightmapPixels[f.lightofs + s * styleSize]);
+				}
+			};
+
+			if (pi != -1)
+			{
+				for (int fi : mergedPolys[pi].faces)
+					writeFace(fi);
+			}
+			else
+			{
+				writeFace(face);
+			}
+		}, 16);
+
+		for (int ai = 0; ai < styleCoverage.size(); ai++)
+			Lightmap::dilate(styleAtlases[ai], styleCoverage[ai], config->lightmapPadding, config->threads);
+
+		// the first page keeps the plain name
+		auto pageSuffix = [](int page) { return page ? std::to_string(page) : std::string(); };
+
+		if (config->lstylesMerge)
+		{
+			for (int p = 0; p < styleAtlases.size(); p++)
+				styleAtlases[p].save((std::string(name) + "_merged_lightmap" + pageSuffix(p) + ".png").c_str(), config->verbose);
+		}
+
+		for (int style : lstyles)
+		{
+			const int ai = styleAtlas[style];
+			if (config->lstylesMerge || ai == -1)
+				continue;
+			// every page of a style is a separate entry
+			for (int p = 0; p < stylePages[style]; p++)
+			{
+				lightstyle_t ls;
+				ls.style = style;
+				ls.image = std::string(name) + "_style" + std::to_string(style) + "_lightmap" + pageSuffix(p) + ".png";
+				ls.width = styleAtlases[ai + p].width;
+				ls.height = styleAtlases[ai + p].height;
+				for (int bi = 0; bi < blocks.size(); bi++)
+				{
+					const Lightmap::RectI &styleBlock = styleBlocks[style][bi];
+					if (styleBlock.w * styleBlock.h == 0 || styleBlock.page != p)
+						continue;
+					ls.blocks.insert(ls.blocks.end(), { blocks[bi].page, blocks[bi].x, blocks[bi].y, blocks[bi].w, blocks[bi].h, styleBlock.x, styleBlock.y });
+				}
+				styleAtlases[ai + p].save(ls.image.c_str(), config->verbose);
+				lightstyles.push_back(std::move(ls));
+			}
+		}
+
+		if (config->lstylesMerge && lstyles.empty() && config->verbose)
+			printf("No lightstyles found\n");
+	};
+
 	if (lightmapPixels.size())
 	{
-		lightmap.pack(lmRects, config->lightmapSize);
+		if (layoutCached)
+		{
+			lmRects.assign(layout.rects.begin(), layout.rects.end());
+			for (int li = 0; li < atlases.size(); li++)
+			{
+				atlases[li].block_width = layout.atlases[li].width;
+				atlases[li].block_height = layout.atlases[li].height;
+				atlases[li].pageCount = layout.atlases[li].pages;
+				atlases[li].initBlock();
+			}
+		}
+		else
+		{
+			std::pmr::vector<Lightmap::RectI> atlasRects(arena);
+			for (int li = 0; li < atlases.size(); li++)
+			{
+				atlasRects.clear();
+				for (int fi = 0; fi < faces.size(); fi++)
+				{
+					if (faceAtlases[fi] == li)
+						atlasRects.push_back(lmRects[fi]);
+				}
+				atlases[li].pack(atlasRects, config->lightmapSize, config->verbose);
+				for (int fi = 0, ri = 0; fi < faces.size(); fi++)
+				{
+					if (faceAtlases[fi] == li)
+						lmRects[fi] = atlasRects[ri++];
+				}
+				atlases[li].initBlock();
+			}
+		}
+
+		for (int li = 0; li < atlases.size(); li++)
+		{
+			if (atlases[li].pageCount > FaceBatches::MAX_PAGES)
+			{
+				fprintf(stderr, "Error: lightmap atlas %d takes %d pages, at most %d are supported, raise -lm\n", li, atlases[li].pageCount, FaceBatches::MAX_PAGES);
+				return false;
+			}
+		}
 
-		lightmap.initBlock();
+		for (int li = 1; li < atlases.size(); li++)
+			atlasFirstImage[li] = atlasFirstImage[li - 1] + atlases[li - 1].pageCount;
+		for (auto &model : models)
+		{
+			if (model.lightmap == -1)
+				continue;
+			model.lightmapPages = atlases[model.lightmap].pageCount;
+			model.lightmap = atlasFirstImage[model.lightmap];
+		}
 	}
 
+	// lightmap and deluxemap luxels are composited in one parallel pass over the packed rects. Faces of a merged
+	// polygon share edge luxels, the first face writes all of them in order, other rects never overlap
+	auto compositeLightmaps = [&]()
+	{
+		parallelFor(lightmapPixels.size() ? (int)faces.size() : 0, config->threads, [&](int face)
+		{
+			const int pi = facePolys[face];
+			if (pi != -1 && mergedPolys[pi].faces[0] != face)
+				return;
+			auto writeFace = [&](int fi)
+			{
+				const auto &f = faces[fi];
+				if (f.styles[0] == 0 && f.lightofs != -1 && lmRects[fi].w * lmRects[fi].h != 0)
+					atlases[faceAtlases[fi]].write(lmRects[fi], &lightmapPixels[f.lightofs], lightmapVecs.size() ? &lightmapVecs[f.lightofs] : nullptr);
+			};
+			if (pi != -1)
+			{
+				for (int fi : mergedPolys[pi].faces)
+					writeFace(fi);
+			}
+			else
+			{
+				writeFace(face);
+			}
+		}, 16);
+	};
+
+	if (layoutCached)
+	{
+		compositeLightmaps();
+		saveLightmaps();
+		lightmapsOnly = true;
+		return true;
+	}
+
+	// every face of a merged polygon keeps its own luxels at an offset inside the polygon block
+	for (int pi = 0; pi < mergedPolys.size(); pi++)
+	{
+		const auto &poly = mergedPolys[pi];
+		const auto block = lmRects[poly.faces[0]];
+		for (int fi : poly.faces)
+		{
+			auto &rect = lmRects[fi];
+			rect = faceLmSizes[fi];
+			if (rect.w * rect.h == 0)
+				continue;
+			rect.page = block.page;
+			int dx = lmMins[fi].x - polyLmMins[pi].x;
+			int dy = lmMins[fi].y - polyLmMins[pi].y;
+			if (block.rotated)
+			{
+				std::swap(rect.w, rect.h);
+				std::swap(dx, dy);
+				rect.rotated = true;
+			}
+			rect.x = block.x + dx;
+			rect.y = block.y + dy;
+		}
+	}
+
+	if (config->lightmapOnly && lightmapPixels.size())
+	{
+		layout.key = layoutKey;
+		layout.atlases.clear();
+		for (const auto &atlas : atlases)
+			layout.atlases.push_back({ atlas.block_width, atlas.block_height, atlas.pageCount });
+		layout.rects.assign(lmRects.begin(), lmRects.end());
+		layout.faceAtlases.clear();
+		if (atlases.size() > 1)
+			layout.faceAtlases.assign(faceAtlases.begin(), faceAtlases.end());
+		layout.save(layoutPath);
+	}
+
+	compositeLightmaps();
+
+	// faces on other lightmap pages or in model atlases go to their own submeshes. The group is the atlas and the
+	// page is the one inside it, faces without a lightmap go with the first world page
+	if (atlases.size() > 1 || atlases[0].pageCount > 1)
+	{
+		for (size_t ei = 0; ei < batches.entries.size(); ei++)
+		{
+			auto &e = batches.entries[ei];
+			const bool lit = lmRects[e.face].page >= 0;
+			e.key = FaceBatches::makeKey(batches.model(ei), lit ? faceAtlases[e.face] : 0, lit ? lmRects[e.face].page : 0, batches.material(ei));
+		}
+		batches.sort();
+		if (config->verbose && atlases[0].pageCount > 1)
+			printf("Lightmap takes %d pages\n", atlases[0].pageCount);
+	}
+
+	// bake faces of non-moving brush entities into the world
+	std::pmr::vector<int> faceBatchModels(arena);
+	if (config->staticBatching)
+	{
+		faceBatchModels.resize(faces.size(), 0);
+		int batchedCount = 0;
+		for (int mi = 1; mi < bspModels.size(); mi++)
+		{
+			if (!models[mi].isStatic)
+				continue;
+			models[mi].batched = true;
+			batchedCount++;
+		}
+		// moved faces go after the world faces of the same material, ordered by their model
+		for (size_t ei = 0; ei < batches.entries.size(); ei++)
+		{
+			const int mi = batches.model(ei);
+			if (!models[mi].batched)
+				continue;
+			auto &e = batches.entries[ei];
+			faceBatchModels[e.face] = mi;
+			e.key = FaceBatches::makeKey(0, batches.group(ei), batches.page(ei), batches.material(ei), mi);
+		}
+		batches.sort();
+		if (config->verbose)
+			printf("Batched %d static brush models into the world\n", batchedCount);
+	}
+
+	// merged polygons are triangulated first, the layout needs their index counts
+	std::pmr::vector<std::vector<int> > polyTriangles(mergedPolys.size(), arena);
+	parallelFor((int)mergedPolys.size(), config->threads, [&](int pi)
+	{
+		const auto &poly = mergedPolys[pi];
+		std::vector<vec3_t> points(poly.corners.size());
+		for (int j = 0; j < points.size(); j++)
+		{
+			points[j] = bspVertices[poly.corners[j].vertex];
+			if (faceBatchModels.size() && faceBatchModels[poly.faces[0]])
+				points[j] = points[j] + models[faceBatchModels[poly.faces[0]]].position;
+		}
+		FaceMerger::triangulate(points.data(), (int)points.size(), polyTriangles[pi]);
+	}, 16);
+
+	// the layout pass places every face in the vertex and index buffers, then faces are filled in parallel
+	struct faceJob_t
+	{
+		int face;
+		int vertOffset;	// in vertices
+		int indOffset;	// in indices
+		int indVertOffset;	// index of the first face vertex inside its mesh
+	};
+	std::pmr::vector<faceJob_t> faceJobs(arena);
 	int indicesOffset = 0;
+	int vertexCount = (int)vertices.size();
+	size_t modelBegin = 0;
 	for (int mi = 0; mi < bspModels.size(); mi++)
 	{
-		const auto &m = bspModels[mi];
+		size_t modelEnd = modelBegin;
+		if (modelBegin < batches.entries.size() && batches.model(modelBegin) == mi)
+			modelEnd = batches.runEnd(modelBegin, FaceBatches::MODEL_BITS);
 
 		models[mi].meshes.push_back({});
 		mesh_t *mesh = &models[mi].meshes.back();
 
 		mesh->count = 0;
 		mesh->offset = indicesOffset;
-		mesh->vertOffset = (int)vertices.size();
+		mesh->vertOffset = vertexCount;
 		int indVertOffset = 0;
-		for (auto &mat : modelMaterialFaces[mi])
+		for (size_t matBegin = modelBegin; matBegin < modelEnd;)
 		{
+			const size_t matEnd = batches.runEnd(matBegin, FaceBatches::MATERIAL_BITS);
 			submesh_t submesh;
-			submesh.material = mat.first;
+			submesh.material = batches.material(matBegin);
+			submesh.lightmap = atlasFirstImage[batches.group(matBegin)] + batches.page(matBegin);
 			submesh.offset = indicesOffset;
 			submesh.count = 0;
 
-			for (int i = 0; i < mat.second.size(); i++)
+			for (size_t ei = matBegin; ei < matEnd; ei++)
 			{
-				const auto &f = faces[mat.second[i]];
-				const auto &ti = texinfos[f.texinfo];
-				const auto &plane = planes[f.planenum];
+				const int face = batches.entries[ei].face;
+				const auto &f = faces[face];
+				const int pi = facePolys[face];
+				const int numVerts = (pi != -1) ? (int)mergedPolys[pi].corners.size() : f.numedges;
 
-				if (config->uint16Inds && (indVertOffset + f.numedges >= UINT16_MAX - 1))
+				if (config->uint16Inds && (indVertOffset + numVerts >= UINT16_MAX - 1))
 				{
-					mesh->vertCount = (int)vertices.size() - mesh->vertOffset;
+					mesh->vertCount = vertexCount - mesh->vertOffset;
 					if (submesh.count)
 					{
 						indicesOffset += submesh.count;
@@ -254,167 +951,176 @@ bool Map::load_hlbsp(FILE *f, const char *name, LoadConfig *config)
 
 					mesh->count = 0;
 					mesh->offset = indicesOffset;
-					mesh->vertOffset = (int)vertices.size();
+					mesh->vertOffset = vertexCount;
 					indVertOffset = 0;
 
-					submesh.material = mat.first;
 					submesh.offset = indicesOffset;
 					submesh.count = 0;
 				}
 
-				size_t faceVertOffset = vertices.size();
-
-				for (int j = 0; j < f.numedges; j++)
-				{
-					int e = surfedges[f.firstedge + j];
-					int vi = edges[abs(e)].v[(e > 0 ? 0 : 1)];
-					vert_t v{ bspVertices[vi], plane.normal };
-					if (f.side)
-					{
-						v.norm.x = -v.norm.x;
-						v.norm.y = -v.norm.y;
-						v.norm.z = -v.norm.z;
-					}
-					v.uv = { v.pos.dot(ti.texVecS) + ti.texOffS, v.pos.dot(ti.texVecT) + ti.texOffT };
-					vertices.push_back(v);
-				}
-
-				if (lightmapPixels.size() && f.lightofs != -1)
-				{
-					auto &rect = lmRects[mat.second[i]];
-					int sampleSize = lmSampleSize;
-					if (ti.faceInfo >= 0 && ti.faceInfo < faceInfos.size())
-						sampleSize = faceInfos[ti.faceInfo].textureStep;
-
-					vec2i_t mins = lmMins[mat.second[i]];
-					if (f.styles[0] == 0)
-						lightmap.write(rect, &lightmapPixels[f.lightofs], lightmapVecs.size() ? &lightmapVecs[f.lightofs] : nullptr);
-
-					for (int j = 0; j < f.numedges; j++)
-					{
-						vert_t &v = vertices[faceVertOffset + j];
-						if (f.styles[0] != 255)
-						{
-							v.uv2.x = (v.uv.x - mins.x * sampleSize + rect.x * sampleSize + sampleSize * 0.5f) / (lightmap.block_width * sampleSize);
-							v.uv2.y = (v.uv.y - mins.y * sampleSize + rect.y * sampleSize + sampleSize * 0.5f) / (lightmap.block_height * sampleSize);
-						}
-						else
-						{
-							v.uv2 = { 1.0f - (0.5f / lightmap.block_width), 1.0f - (0.5f / lightmap.block_height) };
-						}
-					}
-				}
-
-				const Texture &tex = textures[ti.miptex];
-				if (tex.width && tex.height)
-				{
-					for (int j = 0; j < f.numedges; j++)
-					{
-						vert_t &v = vertices[faceVertOffset + j];
-						v.uv.x /= tex.width;
-						v.uv.y /= tex.height;
-					}
-				}
-
-				// turn TRIANGLE_FAN into TRIANGLES
-				for (int j = 1; j < f.numedges - 1; j++)
-				{
-					if (config->uint16Inds)
-					{
-						indices16.push_back(indVertOffset);
-						indices16.push_back(indVertOffset + j + 1);
-						indices16.push_back(indVertOffset + j);
-					}
-					else
-					{
-						indices32.push_back(indVertOffset);
-						indices32.push_back(indVertOffset + j + 1);
-						indices32.push_back(indVertOffset + j);
-					}
-				}
-				submesh.count += (f.numedges - 2) * 3;
-				indVertOffset += f.numedges;
+				faceJobs.push_back({ face, vertexCount, indicesOffset + submesh.count, indVertOffset });
+				vertexCount += numVerts;
+				submesh.count += (pi != -1) ? (int)polyTriangles[pi].size() : (f.numedges - 2) * 3;
+				indVertOffset += numVerts;
 			}
 			if (submesh.count)
 				mesh->submeshes.push_back(submesh);
 
 			mesh->count += submesh.count;
 			indicesOffset += submesh.count;
+			matBegin = matEnd;
 		}
-		mesh->vertCount = (int)vertices.size() - mesh->vertOffset;
+		mesh->vertCount = vertexCount - mesh->vertOffset;
+		modelBegin = modelEnd;
 	}
 
-	if (lightmapPixels.size())
-	{
-		lightmap.uploadBlock(name, config->verbose);
+	vertices.resize(vertexCount);
+	if (config->uint16Inds)
+		indices16.resize(indicesOffset);
+	else
+		indices32.resize(indicesOffset);
 
-		std::set<int> lstyles;
-		for (int i = 0; i < faces.size(); i++)
+	// scratch for one face per thread: corner positions, texture coordinates and lightmap offsets
+	enum { CORNER_X, CORNER_Y, CORNER_Z, CORNER_S, CORNER_T, CORNER_U, CORNER_V, LM_SUB_S, LM_ADD_S, LM_SUB_T, LM_ADD_T, CORNER_ARRAYS };
+	parallelFor((int)faceJobs.size(), config->threads, [&](int ji)
+	{
+		const faceJob_t &job = faceJobs[ji];
+		const auto &f = faces[job.face];
+		const auto &ti = texinfos[f.texinfo];
+		const auto &plane = planes[f.planenum];
+		const int pi = facePolys[job.face];
+		const FaceMerger::polygon_t *poly = (pi != -1) ? &mergedPolys[pi] : nullptr;
+		const int numVerts = poly ? (int)poly->corners.size() : f.numedges;
+		vert_t *faceVerts = &vertices[job.vertOffset];
+
+		thread_local std::vector<float> scratch;
+		scratch.resize(numVerts * CORNER_ARRAYS);
+		auto corners = [&](int array) { return &scratch[array * numVerts]; };
+
+		for (int j = 0; j < numVerts; j++)
 		{
-			const dface_t &f = faces[i];
-			for (int j = 0; j < LM_STYLES && f.styles[j] != 255; j++)
+			int vi;
+			if (poly)
 			{
-				if (f.styles[j] != 0 && (config->lstylesAll || config->lstylesMerge || f.styles[j] == config->lstyle))
-				{
-					lstyles.insert(f.styles[j]);
-					if (config->lstylesMerge)
-						break;
-				}
+				vi = poly->corners[j].vertex;
+			}
+			else
+			{
+				int e = surfedges[f.firstedge + j];
+				vi = edges[abs(e)].v[(e > 0 ? 0 : 1)];
 			}
+			corners(CORNER_X)[j] = bspVertices[vi].x;
+			corners(CORNER_Y)[j] = bspVertices[vi].y;
+			corners(CORNER_Z)[j] = bspVertices[vi].z;
+		}
+		faceuv::texCoords(corners(CORNER_X), corners(CORNER_Y), corners(CORNER_Z), numVerts, ti.texVecS, ti.texOffS, ti.texVecT, ti.texOffT, corners(CORNER_S), corners(CORNER_T));
 
-			if (config->lstylesMerge && lstyles.size())
-				break;
+		vec3_t norm = plane.normal;
+		if (f.side)
+		{
+			norm.x = -norm.x;
+			norm.y = -norm.y;
+			norm.z = -norm.z;
 		}
+		vec3_t offset{ 0, 0, 0 };
+		const bool moved = faceBatchModels.size() && faceBatchModels[job.face];
+		if (moved)
+			offset = models[faceBatchModels[job.face]].position;
 
-		for (auto it = lstyles.begin(); it != lstyles.end(); it++)
+		for (int j = 0; j < numVerts; j++)
 		{
-			Texture lmap2(lightmap.block_width, lightmap.block_height, Texture::RGB8);
+			vert_t &v = faceVerts[j];
+			v.pos = { corners(CORNER_X)[j], corners(CORNER_Y)[j], corners(CORNER_Z)[j] };
+			if (moved)
+				v.pos = v.pos + offset;
+			v.norm = norm;
+			v.uv = { corners(CORNER_S)[j], corners(CORNER_T)[j] };
+			v.uv2 = { 0, 0 };
+		}
 
-			for (int i = 0; i < lmRects.size(); i++)
+		if (lightmapPixels.size() && f.lightofs != -1)
+		{
+			int sampleSize = lmSampleSize;
+			if (ti.faceInfo >= 0 && ti.faceInfo < faceInfos.size())
+				sampleSize = faceInfos[ti.faceInfo].textureStep;
+			// texture units per luxel of the face, coarser on a scaled face
+			const float step = sampleSize / lmScales[job.face];
+
+			const Lightmap &atlas = atlases[faceAtlases[job.face]];
+			if (f.styles[0] != 255)
 			{
-				const dface_t &f = faces[i];
-				const Lightmap::RectI &rect = lmRects[i];
-				if (rect.w * rect.h == 0)
-					continue;
-				std::vector<uint8_t> flmap(rect.w * rect.h * 3);
-				memset(&flmap[0], 0, flmap.size());
-				int lmOffset = 0;
-				for (int s = 0; s < LM_STYLES && f.styles[s] != 255; s++)
+				// u follows t in a rotated rect, a polygon block rotates all of its faces
+				const bool rotated = lmRects[job.face].rotated;
+				for (int j = 0; j < numVerts; j++)
 				{
-					if (config->lstylesMerge || f.styles[s] == *it)
-					{
-						for (int l = 0; l < flmap.size(); l++)
-						{
-							int val = flmap[l] + lightmapPixels[f.lightofs + lmOffset + l];
-							flmap[l] = (val > 255) ? 255 : val;
-						}
-					}
-					lmOffset += rect.w * rect.h * 3;
+					// all faces of a polygon share the luxel grid, so any of them gives the same result
+					int cfi = poly ? poly->corners[j].face : job.face;
+					corners(LM_SUB_S)[j] = float((rotated ? lmMins[cfi].y : lmMins[cfi].x) * step);
+					corners(LM_ADD_S)[j] = float(lmRects[cfi].x * step);
+					corners(LM_SUB_T)[j] = float((rotated ? lmMins[cfi].x : lmMins[cfi].y) * step);
+					corners(LM_ADD_T)[j] = float(lmRects[cfi].y * step);
 				}
+				faceuv::lightmapCoords(corners(rotated ? CORNER_T : CORNER_S), corners(rotated ? CORNER_S : CORNER_T), numVerts,
+					corners(LM_SUB_S), corners(LM_ADD_S), corners(LM_SUB_T), corners(LM_ADD_T),
+					step * 0.5f, float(atlas.block_width * step), float(atlas.block_height * step),
+					corners(CORNER_U), corners(CORNER_V));
+				for (int j = 0; j < numVerts; j++)
+					faceVerts[j].uv2 = { corners(CORNER_U)[j], corners(CORNER_V)[j] };
+			}
+			else
+			{
+				for (int j = 0; j < numVerts; j++)
+					faceVerts[j].uv2 = { 1.0f - (0.5f / atlas.block_width), 1.0f - (0.5f / atlas.block_height) };
+			}
+		}
 
-				const uint8_t *data = flmap.data();
-				uint8_t *dst = lmap2.get(rect.x, rect.y);
-				for (int i = 0; i < rect.h; i++)
-				{
-					memcpy(dst, data, rect.w * 3);
-					dst += lmap2.width * 3;
-					data += rect.w * 3;
-				}
+		const Texture &tex = textures[ti.miptex];
+		if (tex.width && tex.height)
+		{
+			for (int j = 0; j < numVerts; j++)
+			{
+				vert_t &v = faceVerts[j];
+				v.uv.x /= tex.width;
+				v.uv.y /= tex.height;
+			}
+		}
+
+		auto writeTriangle = [&](int at, int a, int b, int c)
+		{
+			if (config->uint16Inds)
+			{
+				indices16[at + 0] = job.indVertOffset + a;
+				indices16[at + 1] = job.indVertOffset + b;
+				indices16[at + 2] = job.indVertOffset + c;
 			}
-			if (config->lstylesMerge)
-				lmap2.save((std::string(name) + "_merged_lightmap.png").c_str(), config->verbose);
 			else
-				lmap2.save((std::string(name) + "_style" + std::to_string(*it) + "_lightmap.png").c_str(), config->verbose);
+			{
+				indices32[at + 0] = job.indVertOffset + a;
+				indices32[at + 1] = job.indVertOffset + b;
+				indices32[at + 2] = job.indVertOffset + c;
+			}
+		};
+
+		if (poly)
+		{
+			const auto &polyTris = polyTriangles[pi];
+			for (int j = 0; j < polyTris.size(); j += 3)
+				writeTriangle(job.indOffset + j, polyTris[j], polyTris[j + 2], polyTris[j + 1]);
+		}
+		else
+		{
+			// turn TRIANGLE_FAN into TRIANGLES
+			for (int j = 1; j < f.numedges - 1; j++)
+				writeTriangle(job.indOffset + (j - 1) * 3, 0, j + 1, j);
 		}
+	});
 
-		if (config->lstylesMerge && lstyles.empty() && config->verbose)
-			printf("No lightstyles found\n");
-	}
+	saveLightmaps();
 
 	return true;
 }
 
-void Map::hlbsp_loadTextures(FILE *f, int fileofs, int filelen, std::vector<WadFile> &wads, bool verbose)
+void Map::hlbsp_loadTextures(FILE *f, int fileofs, int filelen, std::vector<std::shared_ptr<const WadFile> > &wads, bool verbose, bool namesOnly)
 {
 	using namespace hlbsp;
 	if (!filelen)
@@ -447,31 +1153,36 @@ void Map::hlbsp_loadTextures(FILE *f, int fileofs, int filelen, std::vector<WadF
 		textures[i].name = texHeader.name;
 		textures[i].width = texHeader.width;
 		textures[i].height = texHeader.height;
-
-		std::vector<uint8_t> buffer;
+		if (namesOnly)
+			continue;
 
 		if (texHeader.offsets[0] == 0)
 		{
-			// reference to a texture stored inside a *.wad
-			int w = 0;
-			for (; w < wads.size(); w++)
+			// reference to a texture stored inside a *.wad, decoded once for all maps of the run. The wads are
+			// indexed when they are loaded, the first one with the name wins
+			std::shared_ptr<const Texture> tex;
+			for (const auto &wad : wads)
 			{
-				if (wads[w].findLump(texHeader.name, buffer))
+				const int lump = wad ? wad->findLumpIndex(texHeader.name) : -1;
+				if (lump != -1)
+				{
+					tex = WadCache::shared().texture(wad, lump);
 					break;
+				}
 			}
 
-			if (w == wads.size())
+			if (!tex)
 				continue; // not found
+			textures[i] = *tex;
 		}
 		else
 		{
-			buffer.resize(sizeof(mip_t) + ((texHeader.width * texHeader.height * 85) >> 6) + sizeof(uint16_t) + 256 * 3);
+			std::vector<uint8_t> buffer(sizeof(mip_t) + ((texHeader.width * texHeader.height * 85) >> 6) + sizeof(uint16_t) + 256 * 3);
 			fseek(f, fileofs + texOffs[i], SEEK_SET);
 			fread(&buffer[0], buffer.size(), 1, f);
+			LoadMipTexture(buffer.data(), buffer.size(), textures[i]);
 		}
 
-		LoadMipTexture(&buffer[0], textures[i]);
-
 		if (verbose)
 			printf("Loaded texture: %s \t%dx%d\n", textures[i].name.c_str(), textures[i].width, textures[i].height);
 	}
@@ -496,6 +1207,9 @@ void Map::parseEntities(const char *src, size_t size)
 
 		std::string model;
 		std::string origin;
+		std::string classname;
+		std::string targetname;
+		std::string rendermode;
 
 		while (true)
 		{
@@ -552,16 +1266,42 @@ void Map::parseEntities(const char *src, size_t size)
 			{
 				origin = token;
 			}
+			else if (keyname == "classname")
+			{
+				classname = token;
+			}
+			else if (keyname == "targetname")
+			{
+				targetname = token;
+			}
+			else if (keyname == "rendermode")
+			{
+				rendermode = token;
+			}
 		}
 		isWorldSpawn = false;
 
-		if (model.size() && model[0] == '*' && origin.size())
+		if (model.size() && model[0] == '*')
 		{
 			vec3_t v;
 			int modelId = atoi(&model[1]);
-			if ((modelId > 0 && modelId < models.size()) && sscanf(origin.c_str(), "%f %f %f", &v.x, &v.y, &v.z) == 3)
+			if (modelId > 0 && modelId < models.size())
 			{
-				models[modelId].position = v;
+				if (origin.size() && sscanf(origin.c_str(), "%f %f %f", &v.x, &v.y, &v.z) == 3)
+					models[modelId].position = v;
+
+				// entities which can be triggered or need their own render mode may change at runtime
+				if (targetname.empty() && (rendermode.empty() || rendermode == "0"))
+				{
+					for (const char *sc : staticBrushClasses)
+					{
+						if (!strcasecmp(classname.c_str(), sc))
+						{
+							models[modelId].isStatic = true;
+							break;
+						}
+					}
+				}
 			}
 		}
 	}
@@ -63,7 +63,8 @@ enum
 	EXTRA_VERSION	= 4,
 
 	MAX_MAP_HULLS	= 4,
-	LM_STYLES		= 4
+	LM_STYLES		= 4,
+	MIPLEVELS		= 4
 };
 
 struct dlump_t
@@ -153,7 +154,7 @@ struct mip_t
 	char		name[16];
 	uint32_t	width;
 	uint32_t	height;
-	uint32_t	offsets[4];	// four mip maps stored
+	uint32_t	offsets[MIPLEVELS];	// four mip maps stored
 };
 
 }//hlbsp
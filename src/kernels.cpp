@@ -0,0 +1,399 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#include "cpu.h"
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KERNELS_SSE2
+#include <emmintrin.h>
+#endif
+
+// base implementations, SSE2 is always there on x86-64 so it doesn't need dispatch
+
+static void texCoords(const float *x, const float *y, const float *z, int count,
+	const float *vecS, float offS, const float *vecT, float offT, float *s, float *t)
+{
+	int i = 0;
+#ifdef KERNELS_SSE2
+	const __m128 sx = _mm_set1_ps(vecS[0]), sy = _mm_set1_ps(vecS[1]), sz = _mm_set1_ps(vecS[2]), so = _mm_set1_ps(offS);
+	const __m128 tx = _mm_set1_ps(vecT[0]), ty = _mm_set1_ps(vecT[1]), tz = _mm_set1_ps(vecT[2]), to = _mm_set1_ps(offT);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 px = _mm_loadu_ps(x + i);
+		__m128 py = _mm_loadu_ps(y + i);
+		__m128 pz = _mm_loadu_ps(z + i);
+		__m128 ds = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, sx), _mm_mul_ps(py, sy)), _mm_mul_ps(pz, sz));
+		__m128 dt = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz));
+		_mm_storeu_ps(s + i, _mm_add_ps(ds, so));
+		_mm_storeu_ps(t + i, _mm_add_ps(dt, to));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		s[i] = (x[i] * vecS[0] + y[i] * vecS[1] + z[i] * vecS[2]) + offS;
+		t[i] = (x[i] * vecT[0] + y[i] * vecT[1] + z[i] * vecT[2]) + offT;
+	}
+}
+
+static void texBoundsRange(const float *x, const float *y, const float *z, int begin, int end,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	for (int i = begin; i < end; i++)
+	{
+		float s = (float)(x[i] * (double)vecS[0] + y[i] * (double)vecS[1] + z[i] * (double)vecS[2]) + offS;
+		float t = (x[i] * vecT[0] + y[i] * vecT[1] + z[i] * vecT[2]) + offT;
+		mins[0] = fminf(mins[0], s);
+		maxs[0] = fmaxf(maxs[0], s);
+		mins[1] = fminf(mins[1], t);
+		maxs[1] = fmaxf(maxs[1], t);
+	}
+}
+
+static void texBounds(const float *x, const float *y, const float *z, int count,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	int i = 0;
+#ifdef KERNELS_SSE2
+	if (count >= 4)
+	{
+		const __m128d sx = _mm_set1_pd(vecS[0]), sy = _mm_set1_pd(vecS[1]), sz = _mm_set1_pd(vecS[2]);
+		const __m128 so = _mm_set1_ps(offS);
+		const __m128 tx = _mm_set1_ps(vecT[0]), ty = _mm_set1_ps(vecT[1]), tz = _mm_set1_ps(vecT[2]), to = _mm_set1_ps(offT);
+		__m128 vminS = _mm_set1_ps(mins[0]), vmaxS = _mm_set1_ps(maxs[0]);
+		__m128 vminT = _mm_set1_ps(mins[1]), vmaxT = _mm_set1_ps(maxs[1]);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 px = _mm_loadu_ps(x + i);
+			__m128 py = _mm_loadu_ps(y + i);
+			__m128 pz = _mm_loadu_ps(z + i);
+
+			// two doubles per register
+			__m128d dsLo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(px), sx), _mm_mul_pd(_mm_cvtps_pd(py), sy)), _mm_mul_pd(_mm_cvtps_pd(pz), sz));
+			__m128d dsHi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(px, px)), sx), _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(py, py)), sy)), _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(pz, pz)), sz));
+			__m128 s = _mm_add_ps(_mm_movelh_ps(_mm_cvtpd_ps(dsLo), _mm_cvtpd_ps(dsHi)), so);
+			__m128 t = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), to);
+
+			vminS = _mm_min_ps(vminS, s);
+			vmaxS = _mm_max_ps(vmaxS, s);
+			vminT = _mm_min_ps(vminT, t);
+			vmaxT = _mm_max_ps(vmaxT, t);
+		}
+		alignas(16) float r[4][4];
+		_mm_store_ps(r[0], vminS);
+		_mm_store_ps(r[1], vmaxS);
+		_mm_store_ps(r[2], vminT);
+		_mm_store_ps(r[3], vmaxT);
+		float mn[2] = { mins[0], mins[1] }, mx[2] = { maxs[0], maxs[1] };
+		for (int k = 0; k < 4; k++)
+		{
+			mn[0] = fminf(mn[0], r[0][k]);
+			mx[0] = fmaxf(mx[0], r[1][k]);
+			mn[1] = fminf(mn[1], r[2][k]);
+			mx[1] = fmaxf(mx[1], r[3][k]);
+		}
+
+		// lanes lose the order of equal zeros of different sign, the scalar pass decides then
+		if (mn[0] == 0.0f || mx[0] == 0.0f || mn[1] == 0.0f || mx[1] == 0.0f)
+			texBoundsRange(x, y, z, 0, i, vecS, offS, vecT, offT, mins, maxs);
+		else
+		{
+			mins[0] = mn[0];
+			mins[1] = mn[1];
+			maxs[0] = mx[0];
+			maxs[1] = mx[1];
+		}
+	}
+#endif
+	texBoundsRange(x, y, z, i, count, vecS, offS, vecT, offT, mins, maxs);
+}
+
+static void lightmapCoords(const float *s, const float *t, int count, const float *subS, const float *addS,
+	const float *subT, const float *addT, float half, float width, float height, float *u, float *v)
+{
+	int i = 0;
+#ifdef KERNELS_SSE2
+	const __m128 h = _mm_set1_ps(half), w = _mm_set1_ps(width), hh = _mm_set1_ps(height);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 us = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(s + i), _mm_loadu_ps(subS + i)), _mm_loadu_ps(addS + i)), h);
+		__m128 vt = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(t + i), _mm_loadu_ps(subT + i)), _mm_loadu_ps(addT + i)), h);
+		_mm_storeu_ps(u + i, _mm_div_ps(us, w));
+		_mm_storeu_ps(v + i, _mm_div_ps(vt, hh));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		u[i] = (s[i] - subS[i] + addS[i] + half) / width;
+		v[i] = (t[i] - subT[i] + addT[i] + half) / height;
+	}
+}
+
+static void bounds(const void *positions, size_t count, size_t stride, float *mins, float *maxs)
+{
+	const uint8_t *p = (const uint8_t *)positions;
+	for (size_t i = 0; i < count; i++, p += stride)
+	{
+		const float *v = (const float *)p;
+		for (int c = 0; c < 3; c++)
+		{
+			mins[c] = fminf(mins[c], v[c]);
+			maxs[c] = fmaxf(maxs[c], v[c]);
+		}
+	}
+}
+
+// unit normal of the triangle (a, b, c) as (b - a) x (c - a) in the operation order of vec3_t, the components go
+// 'stride' floats apart
+static void triangleNormal(const float *a, const float *b, const float *c, size_t stride, float *n)
+{
+	const float v1x = b[0] - a[0], v1y = b[1] - a[1], v1z = b[2] - a[2];
+	const float v0x = c[0] - a[0], v0y = c[1] - a[1], v0z = c[2] - a[2];
+	const float nx = v1y * v0z - v1z * v0y;
+	const float ny = v1z * v0x - v1x * v0z;
+	const float nz = v1x * v0y - v1y * v0x;
+	const float l = sqrtf(nx * nx + ny * ny + nz * nz);
+	n[0] = nx / l;
+	n[stride] = ny / l;
+	n[stride * 2] = nz / l;
+}
+
+// averages the triangle normals of the quads around every vertex. Quad q of the row qy is qy * (width - 1) + qx,
+// component k of it is quads[k * quadCount + q], 0-2 is the first triangle and 3-5 the second
+static void sumDispNormals(uint8_t *normals, size_t stride, int width, const float *quads)
+{
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	for (int y = 0; y < width; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float n[3] = { 0.0f, 0.0f, 0.0f };
+			int count = 0;
+			auto add = [&](int qx, int qy)
+			{
+				const size_t q = (size_t)qy * qw + qx;
+				for (int k = 0; k < 6; k++)
+					n[k % 3] = n[k % 3] + quads[k * quadCount + q];
+				count += 2;
+			};
+			if (y + 1 < width && x + 1 < width)
+				add(x, y);
+			if (x > 0 && y + 1 < width)
+				add(x - 1, y);
+			if (x > 0 && y > 0)
+				add(x - 1, y - 1);
+			if (x + 1 < width && y > 0)
+				add(x, y - 1);
+
+			const float scale = 1.0f / count;
+			float *out = (float *)(normals + (size_t)(y * width + x) * stride);
+			for (int c = 0; c < 3; c++)
+				out[c] = n[c] * scale;
+		}
+	}
+}
+
+static void dispNormals(const void *positions, void *normals, size_t stride, int width, float *scratch)
+{
+	const uint8_t *p = (const uint8_t *)positions;
+	auto pos = [&](int x, int y) { return (const float *)(p + (size_t)(y * width + x) * stride); };
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	for (int qy = 0; qy < qw; qy++)
+	{
+		for (int qx = 0; qx < qw; qx++)
+		{
+			float *q = scratch + (size_t)qy * qw + qx;
+			triangleNormal(pos(qx, qy), pos(qx + 1, qy), pos(qx, qy + 1), quadCount, q);
+			triangleNormal(pos(qx + 1, qy), pos(qx + 1, qy + 1), pos(qx, qy + 1), quadCount, q + quadCount * 3);
+		}
+	}
+	sumDispNormals((uint8_t *)normals, stride, width, scratch);
+}
+
+static void swapRB(uint8_t *data, size_t pixels, int channels, bool forceAlpha)
+{
+	for (size_t i = 0; i < pixels; i++)
+	{
+		uint8_t t = data[0];
+		data[0] = data[2];
+		data[2] = t;
+		if (forceAlpha && channels == 4)
+			data[3] = 255;
+		data += channels;
+	}
+}
+
+static void expandPalette(const uint8_t *ids, size_t count, const uint32_t *palette, uint8_t *dst, int channels)
+{
+	if (channels == 4)
+	{
+		for (size_t i = 0; i < count; i++)
+			memcpy(dst + i * 4, &palette[ids[i]], 4);
+		return;
+	}
+	if (!count)
+		return;
+	// whole entries overlap the next pixel, the last one is written by bytes
+	for (size_t i = 0; i < count - 1; i++)
+		memcpy(dst + i * 3, &palette[ids[i]], 4);
+	memcpy(dst + (count - 1) * 3, &palette[ids[count - 1]], 3);
+}
+
+static void decodeRgbExp(const uint8_t *src, size_t count, const float *table, uint8_t *dst)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		const float *row = table + (src[3] << 8);
+		float r = row[src[0]];
+		float g = row[src[1]];
+		float b = row[src[2]];
+		float mc = fmaxf(r, fmaxf(g, b));
+		if (mc > 1)
+		{
+			r /= mc;
+			g /= mc;
+			b /= mc;
+		}
+		dst[0] = uint8_t(r * 255);
+		dst[1] = uint8_t(g * 255);
+		dst[2] = uint8_t(b * 255);
+
+		dst += 3;
+		src += 4;
+	}
+}
+
+// the other levels follow these formulas operation by operation
+
+// 2^e of an rgbexp luxel, exponents below the normal float range are raised, their values encode to 0 anyway
+static float rgbexpScale(int8_t e)
+{
+	uint32_t bits = (uint32_t)((e < -126 ? -126 : e) + 127) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static float rgbexpLinear(uint8_t v, float scale)
+{
+	return fminf((float)v * scale / 255.0f, 65504.0f);
+}
+
+static void encodeRgbm(const uint8_t *src, size_t count, uint8_t *dst)
+{
+	for (size_t i = 0; i < count; i++, src += 4, dst += 4)
+	{
+		float scale = rgbexpScale((int8_t)src[3]);
+		float c[3];
+		for (int j = 0; j < 3; j++)
+			c[j] = sqrtf(fminf(rgbexpLinear(src[j], scale), 256.0f));
+		float m = fmaxf(c[0], fmaxf(c[1], c[2]));
+		float a = fmaxf(ceilf(m / 16.0f * 255.0f), 1.0f);
+		float d = a / 255.0f * 16.0f;
+		for (int j = 0; j < 3; j++)
+			dst[j] = uint8_t(c[j] / d * 255.0f + 0.5f);
+		dst[3] = uint8_t(a);
+	}
+}
+
+static void encodeRgbe(const uint8_t *src, size_t count, uint8_t *dst)
+{
+	for (size_t i = 0; i < count; i++, src += 4, dst += 4)
+	{
+		float scale = rgbexpScale((int8_t)src[3]);
+		float c[3];
+		for (int j = 0; j < 3; j++)
+			c[j] = rgbexpLinear(src[j], scale);
+		float m = fmaxf(c[0], fmaxf(c[1], c[2]));
+		if (m < 1e-32f)
+		{
+			memset(dst, 0, 4);
+			continue;
+		}
+		// frexp exponent of m, the mantissa scale 2^(8 - e) is exact
+		uint32_t bits;
+		memcpy(&bits, &m, sizeof(bits));
+		int e = (int)(bits >> 23) - 126;
+		bits = (uint32_t)(127 + 8 - e) << 23;
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		for (int j = 0; j < 3; j++)
+			dst[j] = uint8_t(c[j] * f);
+		dst[3] = uint8_t(e + 128);
+	}
+}
+
+// round to nearest even, f is in [0, 65504]
+static uint16_t floatToHalf(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, sizeof(u));
+	if (u < (113u << 23))
+	{
+		// denormal half, let the float addition do the rounding
+		f += 0.5f;
+		memcpy(&u, &f, sizeof(u));
+		return (uint16_t)(u - (126u << 23));
+	}
+	u += ((uint32_t)(15 - 127) << 23) + 0xFFF + ((u >> 13) & 1);
+	return (uint16_t)(u >> 13);
+}
+
+static void encodeHalf(const uint8_t *src, size_t count, uint8_t *dst)
+{
+	for (size_t i = 0; i < count; i++, src += 4, dst += 8)
+	{
+		float scale = rgbexpScale((int8_t)src[3]);
+		uint16_t h[4] = { 0, 0, 0, 0x3C00 };
+		for (int j = 0; j < 3; j++)
+			h[j] = floatToHalf(rgbexpLinear(src[j], scale));
+		memcpy(dst, h, sizeof(h));
+	}
+}
+
+static void addSaturate(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t i = 0;
+#ifdef KERNELS_SSE2
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(d, _mm_loadu_si128((const __m128i *)(src + i))));
+	}
+#endif
+	for (; i < size; i++)
+	{
+		int val = dst[i] + src[i];
+		dst[i] = (val > 255) ? 255 : val;
+	}
+}
+
+static void scaleAdd(float *dst, const float *src, float weight, size_t count)
+{
+	size_t i = 0;
+#ifdef KERNELS_SSE2
+	const __m128 w = _mm_set1_ps(weight);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), w)));
+#endif
+	for (; i < count; i++)
+		dst[i] += src[i] * weight;
+}
+
+void initKernelsScalar(kernels_t &k)
+{
+	k.texCoords = texCoords;
+	k.texBounds = texBounds;
+	k.lightmapCoords = lightmapCoords;
+	k.bounds = bounds;
+	k.dispNormals = dispNormals;
+	k.swapRB = swapRB;
+	k.expandPalette = expandPalette;
+	k.decodeRgbExp = decodeRgbExp;
+	k.encodeRgbm = encodeRgbm;
+	k.encodeRgbe = encodeRgbe;
+	k.encodeHalf = encodeHalf;
+	k.addSaturate = addSaturate;
+	k.scaleAdd = scaleAdd;
+}
@@ -0,0 +1,386 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+// built with AVX2 enabled, see cpu.h before adding includes
+#include "cpu.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+// no fma, the results have to match the other levels
+static void texCoords(const float *x, const float *y, const float *z, int count,
+	const float *vecS, float offS, const float *vecT, float offT, float *s, float *t)
+{
+	int i = 0;
+	const __m256 sx = _mm256_set1_ps(vecS[0]), sy = _mm256_set1_ps(vecS[1]), sz = _mm256_set1_ps(vecS[2]), so = _mm256_set1_ps(offS);
+	const __m256 tx = _mm256_set1_ps(vecT[0]), ty = _mm256_set1_ps(vecT[1]), tz = _mm256_set1_ps(vecT[2]), to = _mm256_set1_ps(offT);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 px = _mm256_loadu_ps(x + i);
+		__m256 py = _mm256_loadu_ps(y + i);
+		__m256 pz = _mm256_loadu_ps(z + i);
+		__m256 ds = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, sx), _mm256_mul_ps(py, sy)), _mm256_mul_ps(pz, sz));
+		__m256 dt = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz));
+		_mm256_storeu_ps(s + i, _mm256_add_ps(ds, so));
+		_mm256_storeu_ps(t + i, _mm256_add_ps(dt, to));
+	}
+	for (; i < count; i++)
+	{
+		__m128 px = _mm_set_ss(x[i]), py = _mm_set_ss(y[i]), pz = _mm_set_ss(z[i]);
+		__m128 ds = _mm_add_ss(_mm_add_ss(_mm_mul_ss(px, _mm_set_ss(vecS[0])), _mm_mul_ss(py, _mm_set_ss(vecS[1]))), _mm_mul_ss(pz, _mm_set_ss(vecS[2])));
+		__m128 dt = _mm_add_ss(_mm_add_ss(_mm_mul_ss(px, _mm_set_ss(vecT[0])), _mm_mul_ss(py, _mm_set_ss(vecT[1]))), _mm_mul_ss(pz, _mm_set_ss(vecT[2])));
+		s[i] = _mm_cvtss_f32(_mm_add_ss(ds, _mm_set_ss(offS)));
+		t[i] = _mm_cvtss_f32(_mm_add_ss(dt, _mm_set_ss(offT)));
+	}
+}
+
+static void texBoundsRange(const float *x, const float *y, const float *z, int begin, int end,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	for (int i = begin; i < end; i++)
+	{
+		float s = (float)(x[i] * (double)vecS[0] + y[i] * (double)vecS[1] + z[i] * (double)vecS[2]) + offS;
+		float t = (x[i] * vecT[0] + y[i] * vecT[1] + z[i] * vecT[2]) + offT;
+		// keep the first of equal values, like fminf does
+		if (s < mins[0])
+			mins[0] = s;
+		if (s > maxs[0])
+			maxs[0] = s;
+		if (t < mins[1])
+			mins[1] = t;
+		if (t > maxs[1])
+			maxs[1] = t;
+	}
+}
+
+static void texBounds(const float *x, const float *y, const float *z, int count,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	int i = 0;
+	if (count >= 8)
+	{
+		const __m256d sx = _mm256_set1_pd(vecS[0]), sy = _mm256_set1_pd(vecS[1]), sz = _mm256_set1_pd(vecS[2]);
+		const __m256 so = _mm256_set1_ps(offS);
+		const __m256 tx = _mm256_set1_ps(vecT[0]), ty = _mm256_set1_ps(vecT[1]), tz = _mm256_set1_ps(vecT[2]), to = _mm256_set1_ps(offT);
+		__m256 vminS = _mm256_set1_ps(mins[0]), vmaxS = _mm256_set1_ps(maxs[0]);
+		__m256 vminT = _mm256_set1_ps(mins[1]), vmaxT = _mm256_set1_ps(maxs[1]);
+		for (; i + 8 <= count; i += 8)
+		{
+			const __m256 px = _mm256_loadu_ps(x + i);
+			const __m256 py = _mm256_loadu_ps(y + i);
+			const __m256 pz = _mm256_loadu_ps(z + i);
+			// four doubles per register
+			const __m128 xLo = _mm256_castps256_ps128(px), yLo = _mm256_castps256_ps128(py), zLo = _mm256_castps256_ps128(pz);
+			const __m128 xHi = _mm256_extractf128_ps(px, 1), yHi = _mm256_extractf128_ps(py, 1), zHi = _mm256_extractf128_ps(pz, 1);
+			const __m256d dsLo = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(xLo), sx), _mm256_mul_pd(_mm256_cvtps_pd(yLo), sy)), _mm256_mul_pd(_mm256_cvtps_pd(zLo), sz));
+			const __m256d dsHi = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(xHi), sx), _mm256_mul_pd(_mm256_cvtps_pd(yHi), sy)), _mm256_mul_pd(_mm256_cvtps_pd(zHi), sz));
+			const __m256 s = _mm256_add_ps(_mm256_set_m128(_mm256_cvtpd_ps(dsHi), _mm256_cvtpd_ps(dsLo)), so);
+			const __m256 t = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, tx), _mm256_mul_ps(py, ty)), _mm256_mul_ps(pz, tz)), to);
+
+			vminS = _mm256_min_ps(vminS, s);
+			vmaxS = _mm256_max_ps(vmaxS, s);
+			vminT = _mm256_min_ps(vminT, t);
+			vmaxT = _mm256_max_ps(vmaxT, t);
+		}
+		alignas(32) float r[4][8];
+		_mm256_store_ps(r[0], vminS);
+		_mm256_store_ps(r[1], vmaxS);
+		_mm256_store_ps(r[2], vminT);
+		_mm256_store_ps(r[3], vmaxT);
+		float mn[2] = { mins[0], mins[1] }, mx[2] = { maxs[0], maxs[1] };
+		for (int k = 0; k < 8; k++)
+		{
+			mn[0] = r[0][k] < mn[0] ? r[0][k] : mn[0];
+			mx[0] = r[1][k] > mx[0] ? r[1][k] : mx[0];
+			mn[1] = r[2][k] < mn[1] ? r[2][k] : mn[1];
+			mx[1] = r[3][k] > mx[1] ? r[3][k] : mx[1];
+		}
+
+		// lanes lose the order of equal zeros of different sign, the scalar pass decides then
+		if (mn[0] == 0.0f || mx[0] == 0.0f || mn[1] == 0.0f || mx[1] == 0.0f)
+			texBoundsRange(x, y, z, 0, i, vecS, offS, vecT, offT, mins, maxs);
+		else
+		{
+			mins[0] = mn[0];
+			mins[1] = mn[1];
+			maxs[0] = mx[0];
+			maxs[1] = mx[1];
+		}
+	}
+	texBoundsRange(x, y, z, i, count, vecS, offS, vecT, offT, mins, maxs);
+}
+
+static void lightmapCoords(const float *s, const float *t, int count, const float *subS, const float *addS,
+	const float *subT, const float *addT, float half, float width, float height, float *u, float *v)
+{
+	int i = 0;
+	const __m256 h = _mm256_set1_ps(half), w = _mm256_set1_ps(width), hh = _mm256_set1_ps(height);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 us = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_loadu_ps(s + i), _mm256_loadu_ps(subS + i)), _mm256_loadu_ps(addS + i)), h);
+		__m256 vt = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_loadu_ps(t + i), _mm256_loadu_ps(subT + i)), _mm256_loadu_ps(addT + i)), h);
+		_mm256_storeu_ps(u + i, _mm256_div_ps(us, w));
+		_mm256_storeu_ps(v + i, _mm256_div_ps(vt, hh));
+	}
+	for (; i < count; i++)
+	{
+		u[i] = (s[i] - subS[i] + addS[i] + half) / width;
+		v[i] = (t[i] - subT[i] + addT[i] + half) / height;
+	}
+}
+
+static void boundsRange(const uint8_t *p, size_t begin, size_t end, size_t stride, int c, float &mn, float &mx)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		float v = ((const float *)(p + i * stride))[c];
+		// keep the first of equal values, like fminf does
+		if (v < mn)
+			mn = v;
+		if (v > mx)
+			mx = v;
+	}
+}
+
+static void bounds(const void *positions, size_t count, size_t stride, float *mins, float *maxs)
+{
+	const uint8_t *p = (const uint8_t *)positions;
+	size_t i = 0;
+	if (count >= 8 && stride % 4 == 0 && stride * 8 < 0x7FFFFFFF)
+	{
+		const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)stride));
+		__m256 mn[3], mx[3];
+		for (int c = 0; c < 3; c++)
+		{
+			mn[c] = _mm256_set1_ps(mins[c]);
+			mx[c] = _mm256_set1_ps(maxs[c]);
+		}
+		for (; i + 8 <= count; i += 8)
+		{
+			const float *base = (const float *)(p + i * stride);
+			for (int c = 0; c < 3; c++)
+			{
+				__m256 v = _mm256_i32gather_ps(base + c, offsets, 1);
+				mn[c] = _mm256_min_ps(v, mn[c]);
+				mx[c] = _mm256_max_ps(v, mx[c]);
+			}
+		}
+
+		alignas(32) float r[8];
+		for (int c = 0; c < 3; c++)
+		{
+			float cmin = mins[c], cmax = maxs[c];
+			_mm256_store_ps(r, mn[c]);
+			for (int k = 0; k < 8; k++)
+				cmin = r[k] < cmin ? r[k] : cmin;
+			_mm256_store_ps(r, mx[c]);
+			for (int k = 0; k < 8; k++)
+				cmax = r[k] > cmax ? r[k] : cmax;
+
+			// lanes lose the order of equal zeros of different sign, the scalar pass decides then
+			if (cmin == 0.0f || cmax == 0.0f)
+				boundsRange(p, 0, i, stride, c, mins[c], maxs[c]);
+			else
+			{
+				mins[c] = cmin;
+				maxs[c] = cmax;
+			}
+		}
+	}
+	for (int c = 0; c < 3; c++)
+		boundsRange(p, i, count, stride, c, mins[c], maxs[c]);
+}
+
+static void expandPalette(const uint8_t *ids, size_t count, const uint32_t *palette, uint8_t *dst, int channels)
+{
+	size_t i = 0;
+	const int *table = (const int *)palette;
+	if (channels == 4)
+	{
+		for (; i + 8 <= count; i += 8)
+		{
+			__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ids + i)));
+			_mm256_storeu_si256((__m256i *)(dst + i * 4), _mm256_i32gather_epi32(table, idx, 4));
+		}
+	}
+	else
+	{
+		// each half packs 4 pixels into 12 bytes, the halves are stored 12 bytes apart and the second
+		// store covers the spilled bytes of the first one
+		const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+			0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		for (; i + 10 <= count; i += 8)
+		{
+			__m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(ids + i)));
+			__m256i p = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, idx, 4), pack);
+			_mm_storeu_si128((__m128i *)(dst + i * 3), _mm256_castsi256_si128(p));
+			_mm_storeu_si128((__m128i *)(dst + i * 3 + 12), _mm256_extracti128_si256(p, 1));
+		}
+	}
+
+	for (; i < count; i++)
+	{
+		const uint8_t *c = (const uint8_t *)&palette[ids[i]];
+		for (int j = 0; j < channels; j++)
+			dst[i * channels + j] = c[j];
+	}
+}
+
+static void addSaturate(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(d, _mm256_loadu_si256((const __m256i *)(src + i))));
+	}
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(d, _mm_loadu_si128((const __m128i *)(src + i))));
+	}
+	for (; i < size; i++)
+	{
+		int val = dst[i] + src[i];
+		dst[i] = (val > 255) ? 255 : val;
+	}
+}
+
+static void scaleAdd(float *dst, const float *src, float weight, size_t count)
+{
+	size_t i = 0;
+	const __m256 w = _mm256_set1_ps(weight);
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), w)));
+	for (; i < count; i++)
+		dst[i] += src[i] * weight;
+}
+
+// unit normal of the triangle (a, b, c) as (b - a) x (c - a) in the operation order of vec3_t, the components go
+// 'stride' floats apart
+static void triangleNormal(const float *a, const float *b, const float *c, size_t stride, float *n)
+{
+	const float v1x = b[0] - a[0], v1y = b[1] - a[1], v1z = b[2] - a[2];
+	const float v0x = c[0] - a[0], v0y = c[1] - a[1], v0z = c[2] - a[2];
+	const float nx = v1y * v0z - v1z * v0y;
+	const float ny = v1z * v0x - v1x * v0z;
+	const float nz = v1x * v0y - v1y * v0x;
+	const float l = _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(nx * nx + ny * ny + nz * nz)));
+	n[0] = nx / l;
+	n[stride] = ny / l;
+	n[stride * 2] = nz / l;
+}
+
+// averages the triangle normals of the quads around every vertex. Quad q of the row qy is qy * (width - 1) + qx,
+// component k of it is quads[k * quadCount + q], 0-2 is the first triangle and 3-5 the second
+static void sumDispNormals(uint8_t *normals, size_t stride, int width, const float *quads)
+{
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	for (int y = 0; y < width; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float n[3] = { 0.0f, 0.0f, 0.0f };
+			int count = 0;
+			auto add = [&](int qx, int qy)
+			{
+				const size_t q = (size_t)qy * qw + qx;
+				for (int k = 0; k < 6; k++)
+					n[k % 3] = n[k % 3] + quads[k * quadCount + q];
+				count += 2;
+			};
+			if (y + 1 < width && x + 1 < width)
+				add(x, y);
+			if (x > 0 && y + 1 < width)
+				add(x - 1, y);
+			if (x > 0 && y > 0)
+				add(x - 1, y - 1);
+			if (x + 1 < width && y > 0)
+				add(x, y - 1);
+
+			const float scale = 1.0f / count;
+			float *out = (float *)(normals + (size_t)(y * width + x) * stride);
+			for (int c = 0; c < 3; c++)
+				out[c] = n[c] * scale;
+		}
+	}
+}
+
+// 8 quads of a row at once, positions are copied to separate x, y, z arrays first
+static inline void triangleNormal8(const float *ax, const float *bx, const float *cx, size_t plane, size_t quadCount, float *n)
+{
+	const __m256 v1x = _mm256_sub_ps(_mm256_loadu_ps(bx), _mm256_loadu_ps(ax));
+	const __m256 v1y = _mm256_sub_ps(_mm256_loadu_ps(bx + plane), _mm256_loadu_ps(ax + plane));
+	const __m256 v1z = _mm256_sub_ps(_mm256_loadu_ps(bx + plane * 2), _mm256_loadu_ps(ax + plane * 2));
+	const __m256 v0x = _mm256_sub_ps(_mm256_loadu_ps(cx), _mm256_loadu_ps(ax));
+	const __m256 v0y = _mm256_sub_ps(_mm256_loadu_ps(cx + plane), _mm256_loadu_ps(ax + plane));
+	const __m256 v0z = _mm256_sub_ps(_mm256_loadu_ps(cx + plane * 2), _mm256_loadu_ps(ax + plane * 2));
+	const __m256 nx = _mm256_sub_ps(_mm256_mul_ps(v1y, v0z), _mm256_mul_ps(v1z, v0y));
+	const __m256 ny = _mm256_sub_ps(_mm256_mul_ps(v1z, v0x), _mm256_mul_ps(v1x, v0z));
+	const __m256 nz = _mm256_sub_ps(_mm256_mul_ps(v1x, v0y), _mm256_mul_ps(v1y, v0x));
+	const __m256 l = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz)));
+	_mm256_storeu_ps(n, _mm256_div_ps(nx, l));
+	_mm256_storeu_ps(n + quadCount, _mm256_div_ps(ny, l));
+	_mm256_storeu_ps(n + quadCount * 2, _mm256_div_ps(nz, l));
+}
+
+static void dispNormals(const void *positions, void *normals, size_t stride, int width, float *scratch)
+{
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	const size_t plane = (size_t)width * width;
+	float *px = scratch + quadCount * 6;
+	const uint8_t *p = (const uint8_t *)positions;
+	for (size_t i = 0; i < plane; i++, p += stride)
+	{
+		const float *v = (const float *)p;
+		px[i] = v[0];
+		px[i + plane] = v[1];
+		px[i + plane * 2] = v[2];
+	}
+
+	float xyz[3][3];
+	auto pos = [&](int x, int y, float *v)
+	{
+		const size_t i = (size_t)y * width + x;
+		v[0] = px[i];
+		v[1] = px[i + plane];
+		v[2] = px[i + plane * 2];
+		return v;
+	};
+	for (int qy = 0; qy < qw; qy++)
+	{
+		const float *row0 = px + (size_t)qy * width, *row1 = row0 + width;
+		float *q = scratch + (size_t)qy * qw;
+		int qx = 0;
+		for (; qx + 8 <= qw; qx += 8)
+		{
+			triangleNormal8(row0 + qx, row0 + qx + 1, row1 + qx, plane, quadCount, q + qx);
+			triangleNormal8(row0 + qx + 1, row1 + qx + 1, row1 + qx, plane, quadCount, q + qx + quadCount * 3);
+		}
+		for (; qx < qw; qx++)
+		{
+			triangleNormal(pos(qx, qy, xyz[0]), pos(qx + 1, qy, xyz[1]), pos(qx, qy + 1, xyz[2]), quadCount, q + qx);
+			triangleNormal(pos(qx + 1, qy, xyz[0]), pos(qx + 1, qy + 1, xyz[1]), pos(qx, qy + 1, xyz[2]), quadCount, q + qx + quadCount * 3);
+		}
+	}
+	sumDispNormals((uint8_t *)normals, stride, width, scratch);
+}
+
+bool initKernelsAvx2(kernels_t &k)
+{
+	k.addSaturate = addSaturate;
+	k.scaleAdd = scaleAdd;
+	k.expandPalette = expandPalette;
+	k.texCoords = texCoords;
+	k.texBounds = texBounds;
+	k.lightmapCoords = lightmapCoords;
+	k.bounds = bounds;
+	k.dispNormals = dispNormals;
+	return true;
+}
+#else
+bool initKernelsAvx2(kernels_t &k)
+{
+	return false;
+}
+#endif
@@ -0,0 +1,428 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+// built with SSE4.1 enabled, see cpu.h before adding includes
+#include "cpu.h"
+
+#if defined(__SSE4_1__) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+#include <smmintrin.h>
+#include <string.h>
+
+static void texBoundsRange(const float *x, const float *y, const float *z, int begin, int end,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	for (int i = begin; i < end; i++)
+	{
+		float s = (float)(x[i] * (double)vecS[0] + y[i] * (double)vecS[1] + z[i] * (double)vecS[2]) + offS;
+		float t = (x[i] * vecT[0] + y[i] * vecT[1] + z[i] * vecT[2]) + offT;
+		// keep the first of equal values, like fminf does
+		if (s < mins[0])
+			mins[0] = s;
+		if (s > maxs[0])
+			maxs[0] = s;
+		if (t < mins[1])
+			mins[1] = t;
+		if (t > maxs[1])
+			maxs[1] = t;
+	}
+}
+
+static void texBounds(const float *x, const float *y, const float *z, int count,
+	const float *vecS, float offS, const float *vecT, float offT, float *mins, float *maxs)
+{
+	int i = 0;
+	if (count >= 4)
+	{
+		const __m128d sx = _mm_set1_pd(vecS[0]), sy = _mm_set1_pd(vecS[1]), sz = _mm_set1_pd(vecS[2]);
+		const __m128 so = _mm_set1_ps(offS);
+		const __m128 tx = _mm_set1_ps(vecT[0]), ty = _mm_set1_ps(vecT[1]), tz = _mm_set1_ps(vecT[2]), to = _mm_set1_ps(offT);
+		__m128 vminS = _mm_set1_ps(mins[0]), vmaxS = _mm_set1_ps(maxs[0]);
+		__m128 vminT = _mm_set1_ps(mins[1]), vmaxT = _mm_set1_ps(maxs[1]);
+		for (; i + 4 <= count; i += 4)
+		{
+			const __m128 px = _mm_loadu_ps(x + i);
+			const __m128 py = _mm_loadu_ps(y + i);
+			const __m128 pz = _mm_loadu_ps(z + i);
+			// two doubles per register
+			const __m128d dsLo = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(px), sx), _mm_mul_pd(_mm_cvtps_pd(py), sy)), _mm_mul_pd(_mm_cvtps_pd(pz), sz));
+			const __m128d dsHi = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(px, px)), sx), _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(py, py)), sy)), _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(pz, pz)), sz));
+			const __m128 s = _mm_add_ps(_mm_movelh_ps(_mm_cvtpd_ps(dsLo), _mm_cvtpd_ps(dsHi)), so);
+			const __m128 t = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, tx), _mm_mul_ps(py, ty)), _mm_mul_ps(pz, tz)), to);
+
+			vminS = _mm_min_ps(vminS, s);
+			vmaxS = _mm_max_ps(vmaxS, s);
+			vminT = _mm_min_ps(vminT, t);
+			vmaxT = _mm_max_ps(vmaxT, t);
+		}
+		alignas(16) float r[4][4];
+		_mm_store_ps(r[0], vminS);
+		_mm_store_ps(r[1], vmaxS);
+		_mm_store_ps(r[2], vminT);
+		_mm_store_ps(r[3], vmaxT);
+		float mn[2] = { mins[0], mins[1] }, mx[2] = { maxs[0], maxs[1] };
+		for (int k = 0; k < 4; k++)
+		{
+			mn[0] = r[0][k] < mn[0] ? r[0][k] : mn[0];
+			mx[0] = r[1][k] > mx[0] ? r[1][k] : mx[0];
+			mn[1] = r[2][k] < mn[1] ? r[2][k] : mn[1];
+			mx[1] = r[3][k] > mx[1] ? r[3][k] : mx[1];
+		}
+
+		// lanes lose the order of equal zeros of different sign, the scalar pass decides then
+		if (mn[0] == 0.0f || mx[0] == 0.0f || mn[1] == 0.0f || mx[1] == 0.0f)
+			texBoundsRange(x, y, z, 0, i, vecS, offS, vecT, offT, mins, maxs);
+		else
+		{
+			mins[0] = mn[0];
+			mins[1] = mn[1];
+			maxs[0] = mx[0];
+			maxs[1] = mx[1];
+		}
+	}
+	texBoundsRange(x, y, z, i, count, vecS, offS, vecT, offT, mins, maxs);
+}
+
+static void lightmapCoords(const float *s, const float *t, int count, const float *subS, const float *addS,
+	const float *subT, const float *addT, float half, float width, float height, float *u, float *v)
+{
+	int i = 0;
+	const __m128 h = _mm_set1_ps(half), w = _mm_set1_ps(width), hh = _mm_set1_ps(height);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 us = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(s + i), _mm_loadu_ps(subS + i)), _mm_loadu_ps(addS + i)), h);
+		__m128 vt = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(t + i), _mm_loadu_ps(subT + i)), _mm_loadu_ps(addT + i)), h);
+		_mm_storeu_ps(u + i, _mm_div_ps(us, w));
+		_mm_storeu_ps(v + i, _mm_div_ps(vt, hh));
+	}
+	for (; i < count; i++)
+	{
+		u[i] = (s[i] - subS[i] + addS[i] + half) / width;
+		v[i] = (t[i] - subT[i] + addT[i] + half) / height;
+	}
+}
+
+static void swapRB(uint8_t *data, size_t pixels, int channels, bool forceAlpha)
+{
+	size_t i = 0;
+	if (channels == 4)
+	{
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		const __m128i alpha = _mm_set1_epi32(forceAlpha ? (int)0xFF000000 : 0);
+		for (; i + 4 <= pixels; i += 4)
+		{
+			__m128i p = _mm_loadu_si128((const __m128i *)(data + i * 4));
+			_mm_storeu_si128((__m128i *)(data + i * 4), _mm_or_si128(_mm_shuffle_epi8(p, shuffle), alpha));
+		}
+	}
+	else if (channels == 3)
+	{
+		// 5 pixels per step, the 16th byte belongs to the next pixel and stays in place
+		const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+		for (; i + 6 <= pixels; i += 5)
+		{
+			__m128i p = _mm_loadu_si128((const __m128i *)(data + i * 3));
+			_mm_storeu_si128((__m128i *)(data + i * 3), _mm_shuffle_epi8(p, shuffle));
+		}
+	}
+
+	data += i * channels;
+	for (; i < pixels; i++)
+	{
+		uint8_t t = data[0];
+		data[0] = data[2];
+		data[2] = t;
+		if (forceAlpha && channels == 4)
+			data[3] = 255;
+		data += channels;
+	}
+}
+
+static void expandPalette(const uint8_t *ids, size_t count, const uint32_t *palette, uint8_t *dst, int channels)
+{
+	size_t i = 0;
+	if (channels == 4)
+	{
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i p = _mm_setr_epi32((int)palette[ids[i]], (int)palette[ids[i + 1]], (int)palette[ids[i + 2]], (int)palette[ids[i + 3]]);
+			_mm_storeu_si128((__m128i *)(dst + i * 4), p);
+		}
+	}
+	else
+	{
+		// 4 pixels packed into 12 bytes, the store spills 4 bytes into the next pixels
+		const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+		for (; i + 6 <= count; i += 4)
+		{
+			__m128i p = _mm_setr_epi32((int)palette[ids[i]], (int)palette[ids[i + 1]], (int)palette[ids[i + 2]], (int)palette[ids[i + 3]]);
+			_mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(p, pack));
+		}
+	}
+
+	for (; i < count; i++)
+	{
+		const uint8_t *c = (const uint8_t *)&palette[ids[i]];
+		for (int j = 0; j < channels; j++)
+			dst[i * channels + j] = c[j];
+	}
+}
+
+// r, g, b as 4 ints each to 12 bytes of rgb
+static inline __m128i packRgb(__m128i r, __m128i g, __m128i b)
+{
+	const __m128i order = _mm_setr_epi8(0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1);
+	__m128i bytes = _mm_packus_epi16(_mm_packus_epi32(r, g), _mm_packus_epi32(b, b));
+	return _mm_shuffle_epi8(bytes, order);
+}
+
+static void decodeRgbExp(const uint8_t *src, size_t count, const float *table, uint8_t *dst)
+{
+	size_t i = 0;
+	const __m128 one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f);
+	// the 12 byte result is stored as 16, the extra bytes are rewritten by the next step
+	for (; i + 6 <= count; i += 4)
+	{
+		const uint8_t *s = src + i * 4;
+		const float *t0 = table + (s[3] << 8), *t1 = table + (s[7] << 8), *t2 = table + (s[11] << 8), *t3 = table + (s[15] << 8);
+		__m128 r = _mm_setr_ps(t0[s[0]], t1[s[4]], t2[s[8]], t3[s[12]]);
+		__m128 g = _mm_setr_ps(t0[s[1]], t1[s[5]], t2[s[9]], t3[s[13]]);
+		__m128 b = _mm_setr_ps(t0[s[2]], t1[s[6]], t2[s[10]], t3[s[14]]);
+		__m128 mc = _mm_max_ps(r, _mm_max_ps(g, b));
+		__m128 over = _mm_cmpgt_ps(mc, one);
+		r = _mm_blendv_ps(r, _mm_div_ps(r, mc), over);
+		g = _mm_blendv_ps(g, _mm_div_ps(g, mc), over);
+		b = _mm_blendv_ps(b, _mm_div_ps(b, mc), over);
+		__m128i p = packRgb(_mm_cvttps_epi32(_mm_mul_ps(r, scale)), _mm_cvttps_epi32(_mm_mul_ps(g, scale)), _mm_cvttps_epi32(_mm_mul_ps(b, scale)));
+		_mm_storeu_si128((__m128i *)(dst + i * 3), p);
+	}
+
+	for (; i < count; i++)
+	{
+		const uint8_t *s = src + i * 4;
+		const float *row = table + (s[3] << 8);
+		__m128 c = _mm_setr_ps(row[s[0]], row[s[1]], row[s[2]], 0.0f);
+		__m128 mc = _mm_max_ps(c, _mm_max_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 1, 0, 2))));
+		c = _mm_blendv_ps(c, _mm_div_ps(c, mc), _mm_cmpgt_ps(mc, one));
+		alignas(16) int v[4];
+		_mm_store_si128((__m128i *)v, _mm_cvttps_epi32(_mm_mul_ps(c, scale)));
+		dst[i * 3 + 0] = (uint8_t)v[0];
+		dst[i * 3 + 1] = (uint8_t)v[1];
+		dst[i * 3 + 2] = (uint8_t)v[2];
+	}
+}
+
+// linear values of 4 rgbexp luxels, see rgbexpLinear in kernels.cpp
+static inline void rgbexpLinear4(const uint8_t *src, __m128 &r, __m128 &g, __m128 &b)
+{
+	const __m128i lowByte = _mm_set1_epi32(0xFF);
+	const __m128 div = _mm_set1_ps(255.0f), limit = _mm_set1_ps(65504.0f);
+	__m128i v = _mm_loadu_si128((const __m128i *)src);
+	__m128i e = _mm_max_epi32(_mm_srai_epi32(v, 24), _mm_set1_epi32(-126));
+	__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(e, _mm_set1_epi32(127)), 23));
+	r = _mm_min_ps(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(v, lowByte)), scale), div), limit);
+	g = _mm_min_ps(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 8), lowByte)), scale), div), limit);
+	b = _mm_min_ps(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, 16), lowByte)), scale), div), limit);
+}
+
+static inline __m128i packRgba(__m128i r, __m128i g, __m128i b, __m128i a)
+{
+	return _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(a, 24)));
+}
+
+static void encodeRgbm4(const uint8_t *src, uint8_t *dst)
+{
+	const __m128 range = _mm_set1_ps(16.0f), full = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+	const __m128 limit = _mm_set1_ps(256.0f), one = _mm_set1_ps(1.0f);
+	__m128 r, g, b;
+	rgbexpLinear4(src, r, g, b);
+	r = _mm_sqrt_ps(_mm_min_ps(r, limit));
+	g = _mm_sqrt_ps(_mm_min_ps(g, limit));
+	b = _mm_sqrt_ps(_mm_min_ps(b, limit));
+	__m128 m = _mm_max_ps(r, _mm_max_ps(g, b));
+	__m128 a = _mm_max_ps(_mm_ceil_ps(_mm_mul_ps(_mm_div_ps(m, range), full)), one);
+	__m128 d = _mm_mul_ps(_mm_div_ps(a, full), range);
+	__m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_div_ps(r, d), full), half));
+	__m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_div_ps(g, d), full), half));
+	__m128i bi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_div_ps(b, d), full), half));
+	_mm_storeu_si128((__m128i *)dst, packRgba(ri, gi, bi, _mm_cvttps_epi32(a)));
+}
+
+static void encodeRgbe4(const uint8_t *src, uint8_t *dst)
+{
+	__m128 r, g, b;
+	rgbexpLinear4(src, r, g, b);
+	__m128 m = _mm_max_ps(r, _mm_max_ps(g, b));
+	__m128i zero = _mm_castps_si128(_mm_cmplt_ps(m, _mm_set1_ps(1e-32f)));
+	__m128i e = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(m), 23), _mm_set1_epi32(126));
+	__m128 f = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(127 + 8), e), 23));
+	__m128i p = packRgba(_mm_cvttps_epi32(_mm_mul_ps(r, f)), _mm_cvttps_epi32(_mm_mul_ps(g, f)), _mm_cvttps_epi32(_mm_mul_ps(b, f)),
+		_mm_add_epi32(e, _mm_set1_epi32(128)));
+	_mm_storeu_si128((__m128i *)dst, _mm_andnot_si128(zero, p));
+}
+
+// floatToHalf from kernels.cpp for 4 values in [0, 65504]
+static inline __m128i floatToHalf4(__m128 f)
+{
+	__m128i u = _mm_castps_si128(f);
+	__m128i denormal = _mm_cmplt_epi32(u, _mm_set1_epi32(113 << 23));
+	__m128i d = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(f, _mm_set1_ps(0.5f))), _mm_set1_epi32(126 << 23));
+	__m128i odd = _mm_and_si128(_mm_srli_epi32(u, 13), _mm_set1_epi32(1));
+	__m128i n = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(u, _mm_set1_epi32(((15 - 127) << 23) + 0xFFF)), odd), 13);
+	return _mm_blendv_epi8(n, d, denormal);
+}
+
+static void encodeHalf4(const uint8_t *src, uint8_t *dst)
+{
+	__m128 r, g, b;
+	rgbexpLinear4(src, r, g, b);
+	__m128i rg = _mm_or_si128(floatToHalf4(r), _mm_slli_epi32(floatToHalf4(g), 16));
+	__m128i ba = _mm_or_si128(floatToHalf4(b), _mm_set1_epi32(0x3C00 << 16));
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi32(rg, ba));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi32(rg, ba));
+}
+
+// unit normal of the triangle (a, b, c) as (b - a) x (c - a) in the operation order of vec3_t, the components go
+// 'stride' floats apart
+static void triangleNormal(const float *a, const float *b, const float *c, size_t stride, float *n)
+{
+	const float v1x = b[0] - a[0], v1y = b[1] - a[1], v1z = b[2] - a[2];
+	const float v0x = c[0] - a[0], v0y = c[1] - a[1], v0z = c[2] - a[2];
+	const float nx = v1y * v0z - v1z * v0y;
+	const float ny = v1z * v0x - v1x * v0z;
+	const float nz = v1x * v0y - v1y * v0x;
+	const float l = _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(nx * nx + ny * ny + nz * nz)));
+	n[0] = nx / l;
+	n[stride] = ny / l;
+	n[stride * 2] = nz / l;
+}
+
+// averages the triangle normals of the quads around every vertex. Quad q of the row qy is qy * (width - 1) + qx,
+// component k of it is quads[k * quadCount + q], 0-2 is the first triangle and 3-5 the second
+static void sumDispNormals(uint8_t *normals, size_t stride, int width, const float *quads)
+{
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	for (int y = 0; y < width; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			float n[3] = { 0.0f, 0.0f, 0.0f };
+			int count = 0;
+			auto add = [&](int qx, int qy)
+			{
+				const size_t q = (size_t)qy * qw + qx;
+				for (int k = 0; k < 6; k++)
+					n[k % 3] = n[k % 3] + quads[k * quadCount + q];
+				count += 2;
+			};
+			if (y + 1 < width && x + 1 < width)
+				add(x, y);
+			if (x > 0 && y + 1 < width)
+				add(x - 1, y);
+			if (x > 0 && y > 0)
+				add(x - 1, y - 1);
+			if (x + 1 < width && y > 0)
+				add(x, y - 1);
+
+			const float scale = 1.0f / count;
+			float *out = (float *)(normals + (size_t)(y * width + x) * stride);
+			for (int c = 0; c < 3; c++)
+				out[c] = n[c] * scale;
+		}
+	}
+}
+
+// 4 quads of a row at once, positions are copied to separate x, y, z arrays first
+static inline void triangleNormal4(const float *ax, const float *bx, const float *cx, size_t plane, size_t quadCount, float *n)
+{
+	const __m128 v1x = _mm_sub_ps(_mm_loadu_ps(bx), _mm_loadu_ps(ax));
+	const __m128 v1y = _mm_sub_ps(_mm_loadu_ps(bx + plane), _mm_loadu_ps(ax + plane));
+	const __m128 v1z = _mm_sub_ps(_mm_loadu_ps(bx + plane * 2), _mm_loadu_ps(ax + plane * 2));
+	const __m128 v0x = _mm_sub_ps(_mm_loadu_ps(cx), _mm_loadu_ps(ax));
+	const __m128 v0y = _mm_sub_ps(_mm_loadu_ps(cx + plane), _mm_loadu_ps(ax + plane));
+	const __m128 v0z = _mm_sub_ps(_mm_loadu_ps(cx + plane * 2), _mm_loadu_ps(ax + plane * 2));
+	const __m128 nx = _mm_sub_ps(_mm_mul_ps(v1y, v0z), _mm_mul_ps(v1z, v0y));
+	const __m128 ny = _mm_sub_ps(_mm_mul_ps(v1z, v0x), _mm_mul_ps(v1x, v0z));
+	const __m128 nz = _mm_sub_ps(_mm_mul_ps(v1x, v0y), _mm_mul_ps(v1y, v0x));
+	const __m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+	_mm_storeu_ps(n, _mm_div_ps(nx, l));
+	_mm_storeu_ps(n + quadCount, _mm_div_ps(ny, l));
+	_mm_storeu_ps(n + quadCount * 2, _mm_div_ps(nz, l));
+}
+
+static void dispNormals(const void *positions, void *normals, size_t stride, int width, float *scratch)
+{
+	const int qw = width - 1;
+	const size_t quadCount = (size_t)qw * qw;
+	const size_t plane = (size_t)width * width;
+	float *px = scratch + quadCount * 6;
+	const uint8_t *p = (const uint8_t *)positions;
+	for (size_t i = 0; i < plane; i++, p += stride)
+	{
+		const float *v = (const float *)p;
+		px[i] = v[0];
+		px[i + plane] = v[1];
+		px[i + plane * 2] = v[2];
+	}
+
+	float xyz[3][3];
+	auto pos = [&](int x, int y, float *v)
+	{
+		const size_t i = (size_t)y * width + x;
+		v[0] = px[i];
+		v[1] = px[i + plane];
+		v[2] = px[i + plane * 2];
+		return v;
+	};
+	for (int qy = 0; qy < qw; qy++)
+	{
+		const float *row0 = px + (size_t)qy * width, *row1 = row0 + width;
+		float *q = scratch + (size_t)qy * qw;
+		int qx = 0;
+		for (; qx + 4 <= qw; qx += 4)
+		{
+			triangleNormal4(row0 + qx, row0 + qx + 1, row1 + qx, plane, quadCount, q + qx);
+			triangleNormal4(row0 + qx + 1, row1 + qx + 1, row1 + qx, plane, quadCount, q + qx + quadCount * 3);
+		}
+		for (; qx < qw; qx++)
+		{
+			triangleNormal(pos(qx, qy, xyz[0]), pos(qx + 1, qy, xyz[1]), pos(qx, qy + 1, xyz[2]), quadCount, q + qx);
+			triangleNormal(pos(qx + 1, qy, xyz[0]), pos(qx + 1, qy + 1, xyz[1]), pos(qx, qy + 1, xyz[2]), quadCount, q + qx + quadCount * 3);
+		}
+	}
+	sumDispNormals((uint8_t *)normals, stride, width, scratch);
+}
+
+// runs a 4 luxel step over the row, the tail goes through zero padded copies
+template<void (*step)(const uint8_t *, uint8_t *), size_t outSize>
+static void encodeRow(const uint8_t *src, size_t count, uint8_t *dst)
+{
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+		step(src + i * 4, dst + i * outSize);
+	if (i < count)
+	{
+		uint8_t in[16] = {}, out[4 * outSize];
+		memcpy(in, src + i * 4, (count - i) * 4);
+		step(in, out);
+		memcpy(dst + i * outSize, out, (count - i) * outSize);
+	}
+}
+
+bool initKernelsSse41(kernels_t &k)
+{
+	k.texBounds = texBounds;
+	k.lightmapCoords = lightmapCoords;
+	k.swapRB = swapRB;
+	k.expandPalette = expandPalette;
+	k.dispNormals = dispNormals;
+	k.decodeRgbExp = decodeRgbExp;
+	k.encodeRgbm = encodeRow<encodeRgbm4, 4>;
+	k.encodeRgbe = encodeRow<encodeRgbe4, 4>;
+	k.encodeHalf = encodeRow<encodeHalf4, 8>;
+	return true;
+}
+#else
+bool initKernelsSse41(kernels_t &k)
+{
+	return false;
+}
+#endif
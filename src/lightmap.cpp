@@ -1,7 +1,14 @@
 // Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
 #include "lightmap.h"
+#include "cpu.h"
+#include "parallel.h"
+#include <cstdio>
 #include <cstring>
+#include <cerrno>
 #include <cmath>
+#include <climits>
+#include <chrono>
+#include <algorithm>
 
 // atlas packing code from https://github.com/id-Software/Quake-2/blob/master/ref_gl/gl_rsurf.c
 
@@ -10,9 +17,21 @@ void Lightmap::initBlock()
 	if (allocated.size() != block_width)
 		allocated.resize(block_width);
 	memset(allocated.data(), 0, allocated.size() * sizeof(allocated[0]));
-	buffer.create(block_width, block_height, Texture::RGB8);
-	if(haveVecs)
-		bufferVecs.create(block_width, block_height, Texture::RGB8);
+	Texture::Format format = Texture::RGB8;
+	if (hdr == eLightmapHdr::HALF)
+		format = Texture::RGBA16F;
+	else if (hdr != eLightmapHdr::NONE)
+		format = Texture::RGBA8;
+	buffers.resize(pageCount);
+	for (auto &buffer : buffers)
+		buffer.create(block_width, block_height, format);
+	if (haveVecs)
+	{
+		buffersVecs.resize(pageCount);
+		for (auto &bufferVecs : buffersVecs)
+			bufferVecs.create(block_width, block_height, Texture::RGB8);
+	}
+	coverage.assign(padding ? pageCount : 0, std::vector<uint8_t>((size_t)block_width * block_height));
 }
 
 bool Lightmap::allocBlock(RectI &rect)
@@ -51,66 +70,300 @@ bool Lightmap::allocBlock(RectI &rect)
 	return true;
 }
 
-void Lightmap::uploadBlock(const std::string &name, bool verbose)
+std::vector<std::string> Lightmap::uploadBlock(const std::string &name, bool verbose)
 {
-	buffer.save((name + "_lightmap" + std::to_string(current_lightmap_texture) + ".png").c_str(), verbose);
-	buffer.clearColor();
-	if (haveVecs)
+	std::vector<std::string> paths;
+	for (int page = 0; page < buffers.size(); page++)
 	{
-		bufferVecs.save((name + "_deluxemap" + std::to_string(current_lightmap_texture) + ".png").c_str(), verbose);
-		bufferVecs.clearColor();
+		std::string path = name + "_lightmap" + std::to_string(page) + (hdr == eLightmapHdr::HALF ? ".ktx2" : ".png");
+		buffers[page].save(path.c_str(), verbose);
+		buffers[page].clearColor();
+		if (haveVecs)
+		{
+			buffersVecs[page].save((name + "_deluxemap" + std::to_string(page) + ".png").c_str(), verbose);
+			buffersVecs[page].clearColor();
+		}
+		if (coverage.size())
+			std::fill(coverage[page].begin(), coverage[page].end(), 0);
+		paths.push_back(path);
 	}
-	current_lightmap_texture++;
+	return paths;
+}
+
+// every channel of a luxel depends only on its value and the shared exponent, so the gamma curve is
+// evaluated once for all 256x256 pairs. Index is exponent byte << 8 | value
+static const float *rgbexpTable()
+{
+	static const std::vector<float> table = []()
+	{
+		std::vector<float> t(256 * 256);
+		for (int exp = 0; exp < 256; exp++)
+		{
+			float e = powf(2.0f, (int8_t)exp);
+			for (int v = 0; v < 256; v++)
+				t[(exp << 8) | v] = pow(v * e / 255.0f, 1.0f / 2.2f) * 0.5f;
+		}
+		return t;
+	}();
+	return table.data();
 }
 
 void Lightmap::write(const RectI &rect, uint8_t *data, uint8_t *dataVecs)
 {
-	uint8_t *dst = buffer.get(rect.x, rect.y);
-	if (rgbexp)
+	if (rect.page < 0 || rect.page >= buffers.size())
+		return;
+	if (coverage.size())
 	{
-		for (int i = 0; i < rect.h; i++)
+		for (int y = rect.y; y < rect.y + rect.h; y++)
+			memset(&coverage[rect.page][(size_t)y * block_width + rect.x], 1, rect.w);
+	}
+	// a rotated rect is filled column by column, every luxel row goes through a scratch row first.
+	// The deluxemap row is written in the same pass
+	const int rowLength = rect.rotated ? rect.h : rect.w;
+	const int rows = rect.rotated ? rect.w : rect.h;
+	Texture *bufferVecs = (haveVecs && dataVecs) ? &buffersVecs[rect.page] : nullptr;
+	thread_local std::vector<uint8_t> scratch;
+	auto writeRows = [&](auto &&convert)
+	{
+		Texture &buffer = buffers[rect.page];
+		const int pixelSize = buffer.pixelSize();
+		const size_t pitch = (size_t)buffer.width * pixelSize;
+		const size_t pitchVecs = (size_t)block_width * 3;
+		uint8_t *dst = buffer.get(rect.x, rect.y);
+		uint8_t *dstVecs = bufferVecs ? bufferVecs->get(rect.x, rect.y) : nullptr;
+		if (rect.rotated)
+			scratch.resize((size_t)rowLength * pixelSize);
+		for (int i = 0; i < rows; i++)
 		{
-			for (int j = 0; j < rect.w; j++)
+			if (!rect.rotated)
 			{
-				float e = powf(2.0f, ((int8_t *)data)[3]);
-				float r = pow(data[0] * e / 255.0f, 1.0f / 2.2f) * 0.5f;
-				float g = pow(data[1] * e / 255.0f, 1.0f / 2.2f) * 0.5f;
-				float b = pow(data[2] * e / 255.0f, 1.0f / 2.2f) * 0.5f;
-				float mc = fmax(r, fmax(g, b));
-				if (mc > 1) {
-					r /= mc;
-					g /= mc;
-					b /= mc;
+				convert(dst);
+				dst += pitch;
+				if (dstVecs)
+				{
+					memcpy(dstVecs, dataVecs, rowLength * 3);
+					dstVecs += pitchVecs;
+					dataVecs += rowLength * 3;
 				}
-				dst[0] = uint8_t(r * 255);
-				dst[1] = uint8_t(g * 255);
-				dst[2] = uint8_t(b * 255);
-
-				dst += 3;
-				data += 4;
+				continue;
+			}
+			convert(scratch.data());
+			for (int j = 0; j < rowLength; j++)
+				memcpy(dst + j * pitch, &scratch[j * pixelSize], pixelSize);
+			dst += pixelSize;
+			if (dstVecs)
+			{
+				for (int j = 0; j < rowLength; j++)
+					memcpy(dstVecs + j * pitchVecs, dataVecs + j * 3, 3);
+				dstVecs += 3;
+				dataVecs += rowLength * 3;
 			}
-			dst += (buffer.width - rect.w) * 3;
 		}
+	};
+
+	if (hdr != eLightmapHdr::NONE)
+	{
+		auto encode = hdr == eLightmapHdr::RGBM ? kernels().encodeRgbm : hdr == eLightmapHdr::RGBE ? kernels().encodeRgbe : kernels().encodeHalf;
+		writeRows([&](uint8_t *dst)
+		{
+			encode(data, rowLength, dst);
+			data += rowLength * 4;
+		});
+	}
+	else if (rgbexp)
+	{
+		const float *table = rgbexpTable();
+		writeRows([&](uint8_t *dst)
+		{
+			kernels().decodeRgbExp(data, rowLength, table, dst);
+			data += rowLength * 4;
+		});
 	}
 	else
 	{
-		for (int i = 0; i < rect.h; i++)
+		writeRows([&](uint8_t *dst)
 		{
-			memcpy(dst, data, rect.w * 3);
-			dst += buffer.width * 3;
-			data += rect.w * 3;
+			memcpy(dst, data, rowLength * 3);
+			data += rowLength * 3;
+		});
+	}
+}
+
+void Lightmap::dilate(int threads)
+{
+	for (int page = 0; page < coverage.size(); page++)
+	{
+		dilate(buffers[page], coverage[page], padding, threads);
+		if (haveVecs)
+			dilate(buffersVecs[page], coverage[page], padding, threads);
+	}
+}
+
+void Lightmap::dilate(Texture &atlas, const std::vector<uint8_t> &coverage, int radius, int threads)
+{
+	// side neighbours go first, so a straight edge is extended as it is
+	static const int neighbours[8][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 }, { -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 } };
+	const int w = atlas.width;
+	const int h = atlas.height;
+	const int pixelSize = atlas.pixelSize();
+	std::vector<uint8_t> filled = coverage;
+	std::vector<uint8_t> next;
+	// a ring only copies texels filled before it, texels are copied as they are in any format
+	for (int ring = 0; ring < radius; ring++)
+	{
+		next = filled;
+		parallelFor(h, threads, [&](int y)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				if (filled[(size_t)y * w + x])
+					continue;
+				for (const auto &n : neighbours)
+				{
+					const int nx = x + n[0];
+					const int ny = y + n[1];
+					if (nx < 0 || ny < 0 || nx >= w || ny >= h || !filled[(size_t)ny * w + nx])
+						continue;
+					memcpy(atlas.get(x, y), atlas.get(nx, ny), pixelSize);
+					next[(size_t)y * w + x] = 1;
+					break;
+				}
+			}
+		}, 16);
+		filled.swap(next);
+	}
+}
+
+static const float PI = 3.14159265f;
+
+// taps of every scaled luxel along one axis, (source luxel, weight) pairs, 'offsets' has dstSize + 1 entries
+static void filterTaps(int srcSize, int dstSize, float p0, float step, eLightmapFilter filter,
+	std::vector<int> &offsets, std::vector<int> &ids, std::vector<float> &weights)
+{
+	offsets.assign(1, 0);
+	ids.clear();
+	weights.clear();
+	// minification widens the filter to cover the whole scaled luxel
+	const float scale = std::max(step, 1.0f);
+	const float support = (filter == eLightmapFilter::BOX) ? scale * 0.5f : scale * 3.0f;
+	for (int j = 0; j < dstSize; j++)
+	{
+		const float center = p0 + j * step;
+		const size_t first = ids.size();
+		float sum = 0;
+		for (int i = (int)floorf(center - support); i <= (int)ceilf(center + support); i++)
+		{
+			float wt;
+			if (filter == eLightmapFilter::BOX)
+			{
+				wt = std::min(i + 0.5f, center + support) - std::max(i - 0.5f, center - support);
+			}
+			else
+			{
+				const float x = (i - center) / scale;
+				if (x == 0)
+					wt = 1;
+				else if (fabsf(x) >= 3)
+					wt = 0;
+				else
+					wt = 3 * sinf(PI * x) * sinf(PI * x / 3) / (PI * PI * x * x);
+			}
+			// lanczos keeps its negative lobes
+			if (filter == eLightmapFilter::BOX ? wt <= 0 : wt == 0)
+				continue;
+			// luxels past the block edge repeat the edge
+			ids.push_back(std::clamp(i, 0, srcSize - 1));
+			weights.push_back(wt);
+			sum += wt;
+		}
+		if (sum != 0)
+		{
+			for (size_t t = first; t < weights.size(); t++)
+				weights[t] /= sum;
 		}
+		offsets.push_back((int)ids.size());
 	}
+}
 
-	if (!haveVecs || !dataVecs)
+void Lightmap::resample(const uint8_t *src, int w, int h, uint8_t *dst, int dw, int dh,
+	float x0, float xStep, float y0, float yStep, eLightmapFilter filter, bool rgbexp)
+{
+	// a face that kept its density is copied as is
+	if (dw == w && dh == h && x0 == 0 && y0 == 0 && xStep == 1 && yStep == 1)
+	{
+		memcpy(dst, src, (size_t)w * h * (rgbexp ? 4 : 3));
 		return;
+	}
+
+	thread_local std::vector<int> xOffsets, xIds, yOffsets, yIds;
+	thread_local std::vector<float> xWeights, yWeights, row, columns, acc;
+	filterTaps(w, dw, x0, xStep, filter, xOffsets, xIds, xWeights);
+	filterTaps(h, dh, y0, yStep, filter, yOffsets, yIds, yWeights);
+
+	// horizontal pass into h rows of dw luxels
+	const int srcSize = rgbexp ? 4 : 3;
+	const size_t rowSize = (size_t)dw * 3;
+	row.resize((size_t)w * 3);
+	columns.resize(rowSize * h);
+	for (int y = 0; y < h; y++)
+	{
+		const uint8_t *in = src + (size_t)y * w * srcSize;
+		for (int x = 0; x < w; x++)
+		{
+			const float e = rgbexp ? ldexpf(1.0f, (int8_t)in[x * 4 + 3]) : 1.0f;
+			for (int c = 0; c < 3; c++)
+				row[x * 3 + c] = in[x * srcSize + c] * e;
+		}
+		float *out = &columns[y * rowSize];
+		for (int j = 0; j < dw; j++)
+		{
+			float sum[3] = { 0, 0, 0 };
+			for (int t = xOffsets[j]; t < xOffsets[j + 1]; t++)
+			{
+				for (int c = 0; c < 3; c++)
+					sum[c] += row[xIds[t] * 3 + c] * xWeights[t];
+			}
+			for (int c = 0; c < 3; c++)
+				out[j * 3 + c] = sum[c];
+		}
+	}
 
-	dst = bufferVecs.get(rect.x, rect.y);
-	for (int i = 0; i < rect.h; i++)
+	// vertical pass, whole rows at once
+	acc.resize(rowSize);
+	for (int j = 0; j < dh; j++)
 	{
-		memcpy(dst, dataVecs, rect.w * 3);
-		dst += bufferVecs.width * 3;
-		dataVecs += rect.w * 3;
+		std::fill(acc.begin(), acc.end(), 0.0f);
+		for (int t = yOffsets[j]; t < yOffsets[j + 1]; t++)
+			kernels().scaleAdd(acc.data(), &columns[yIds[t] * rowSize], yWeights[t], rowSize);
+
+		uint8_t *out = dst + (size_t)j * dw * srcSize;
+		for (int x = 0; x < dw; x++)
+		{
+			const float *v = &acc[x * 3];
+			if (!rgbexp)
+			{
+				for (int c = 0; c < 3; c++)
+					out[x * 3 + c] = (uint8_t)std::clamp(v[c] + 0.5f, 0.0f, 255.0f);
+				continue;
+			}
+			// shared exponent that brings the brightest channel into 128..255
+			const float m = std::max(std::max(v[0], v[1]), v[2]);
+			uint8_t *luxel = &out[x * 4];
+			if (m <= 0)
+			{
+				memset(luxel, 0, 4);
+				continue;
+			}
+			int exp;
+			frexpf(m, &exp);
+			exp = std::clamp(exp - 8, -128, 127);
+			if (m * ldexpf(1.0f, -exp) + 0.5f >= 256 && exp < 127)
+				exp++;
+			const float s = ldexpf(1.0f, -exp);
+			for (int c = 0; c < 3; c++)
+				luxel[c] = (uint8_t)std::clamp(std::max(v[c], 0.0f) * s + 0.5f, 0.0f, 255.0f);
+			luxel[3] = (uint8_t)(int8_t)exp;
+		}
 	}
 }
 
@@ -124,49 +377,370 @@ int compareLMRects(const void *rect1, const void *rect2)
 	return r2->h - r1->h;
 }
 
-bool Lightmap::pack(std::vector<RectI> &rects, int max_size)
+// bottom-left skyline: the lowest top edge wins, ties go to the spot that leaves the least area under the rect
+bool Lightmap::allocSkyline(RectI &rect)
+{
+	int bestTop = INT_MAX, bestWaste = INT_MAX, bestNode = -1, bestY = 0;
+	bool bestTurn = false;
+	for (int turn = 0; turn < (allowRotation && rect.w != rect.h ? 2 : 1); turn++)
+	{
+		const int w = turn ? rect.h : rect.w;
+		const int h = turn ? rect.w : rect.h;
+		for (int i = 0; i < skyline.size(); i++)
+		{
+			if (skyline[i].x + w > block_width)
+				break;
+			int y = 0;
+			int j = i;
+			for (int left = w; left > 0; left -= skyline[j++].w)
+				y = std::max(y, skyline[j].y);
+			if (y + h > block_height || y + h > bestTop)
+				continue;
+
+			int waste = 0;
+			for (int k = i, left = w; left > 0; left -= skyline[k++].w)
+				waste += (y - skyline[k].y) * std::min(left, skyline[k].w);
+			if (y + h == bestTop && waste >= bestWaste)
+				continue;
+
+			bestTop = y + h;
+			bestWaste = waste;
+			bestNode = i;
+			bestY = y;
+			bestTurn = turn;
+		}
+	}
+
+	if (bestNode == -1)
+		return false;
+
+	if (bestTurn)
+	{
+		std::swap(rect.w, rect.h);
+		rect.rotated = !rect.rotated;
+	}
+	rect.x = skyline[bestNode].x;
+	rect.y = bestY;
+
+	// the new node covers the rect, nodes under it are cut away
+	const int right = rect.x + rect.w;
+	skyline.insert(skyline.begin() + bestNode, { rect.x, rect.y + rect.h, rect.w });
+	size_t i = bestNode + 1;
+	while (i < skyline.size() && skyline[i].x < right)
+	{
+		const int cut = right - skyline[i].x;
+		if (skyline[i].w > cut)
+		{
+			skyline[i].x += cut;
+			skyline[i].w -= cut;
+			break;
+		}
+		skyline.erase(skyline.begin() + i);
+	}
+
+	for (size_t k = bestNode > 0 ? bestNode - 1 : 0; k + 1 < skyline.size() && k <= bestNode + 1;)
+	{
+		if (skyline[k].y == skyline[k + 1].y)
+		{
+			skyline[k].w += skyline[k + 1].w;
+			skyline.erase(skyline.begin() + k + 1);
+		}
+		else
+		{
+			k++;
+		}
+	}
+
+	return true;
+}
+
+void Lightmap::pack(std::pmr::vector<RectI> &rects, int max_size, bool verbose)
 {
+	const auto startTime = std::chrono::steady_clock::now();
 	block_width = block_height = 32;
+	pageCount = 1;
 
+	int64_t area = 0;
+	int maxW = 0, maxH = 0;
 	for (int i = 0; i < rects.size(); i++)
+	{
 		rects[i].id = i;
+		rects[i].page = 0;
+		rects[i].rotated = false;
+		if (rects[i].w * rects[i].h != 0)
+		{
+			rects[i].w += padding * 2;
+			rects[i].h += padding * 2;
+		}
+		// lying rects give a flatter skyline
+		if (allowRotation && packer == eLightmapPacker::SKYLINE && rects[i].h > rects[i].w)
+		{
+			std::swap(rects[i].w, rects[i].h);
+			rects[i].rotated = true;
+		}
+		area += rects[i].w * rects[i].h;
+		maxW = std::max(maxW, rects[i].w);
+		maxH = std::max(maxH, rects[i].h);
+	}
 
 	std::qsort(&rects[0], rects.size(), sizeof(rects[0]), compareLMRects);
 
-	while (true)
+	auto resetPage = [&]()
 	{
 		allocated.resize(block_width);
 		memset(allocated.data(), 0, allocated.size() * sizeof(allocated[0]));
+		skyline.assign(1, { 0, 0, block_width });
+	};
+	auto place = [&](RectI &rect)
+	{
+		return packer == eLightmapPacker::SKYLINE ? allocSkyline(rect) : allocBlock(rect);
+	};
+	auto packAll = [&]()
+	{
+		resetPage();
+		for (auto &rect : rects)
+		{
+			if (rect.w * rect.h != 0 && !place(rect))
+				return false;
+		}
+		return true;
+	};
+	// atlas sizes go 32x32, 64x32, 64x64 and so on
+	auto setLevel = [&](int level)
+	{
+		block_width = 32 << ((level + 1) / 2);
+		block_height = 32 << (level / 2);
+	};
 
-		size_t i = 0;
-		for (; i < rects.size(); i++)
+	bool fits = false;
+	if (packer == eLightmapPacker::COLUMNS)
+	{
+		while (true)
 		{
-			if (rects[i].w * rects[i].h == 0)
-				continue;
-			if (!allocBlock(rects[i]))
+			if (packAll())
+			{
+				fits = true;
+				break;
+			}
+
+			if (block_height >= block_width)
+				block_width <<= 1;
+			else
+				block_height <<= 1;
+
+			if (block_width > max_size || block_height > max_size)
 				break;
 		}
+	}
+	else
+	{
+		// the smallest size that could hold the total area, then bisect up to the largest allowed one
+		int maxLevel = -1;
+		while (32 << ((maxLevel + 2) / 2) <= max_size && 32 << ((maxLevel + 1) / 2) <= max_size)
+			maxLevel++;
+		int lo = 0;
+		setLevel(lo);
+		while (lo < maxLevel && ((int64_t)block_width * block_height < area || block_width < maxW || block_height < maxH))
+			setLevel(++lo);
 
-		if (i == rects.size())
-			break;
+		int hi = maxLevel;
+		setLevel(hi);
+		if (lo <= hi && packAll())
+		{
+			fits = true;
+			// a failed try leaves the rects half placed, the last one must be repeated then
+			bool placed = true;
+			while (lo < hi)
+			{
+				const int mid = (lo + hi) / 2;
+				setLevel(mid);
+				placed = packAll();
+				if (placed)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			setLevel(hi);
+			if (!placed)
+				packAll();
+		}
+	}
 
-		if (block_height >= block_width)
-			block_width <<= 1;
-		else
-			block_height <<= 1;
+	// full pages, every page takes what still fits in the largest first order
+	if (!fits)
+	{
+		block_width = block_height = max_size;
+		std::pmr::vector<int> left(rects.get_allocator());
+		for (int i = 0; i < rects.size(); i++)
+		{
+			if (rects[i].w * rects[i].h != 0)
+				left.push_back(i);
+		}
 
-		if (block_width > max_size || block_height > max_size)
+		pageCount = 0;
+		while (left.size())
 		{
-			allocated.clear();
-			return false;
+			resetPage();
+			size_t n = 0;
+			for (int i : left)
+			{
+				rects[i].page = pageCount;
+				if (!place(rects[i]))
+					left[n++] = i;
+			}
+			if (n == left.size())
+			{
+				for (int i : left)
+				{
+					printf("Warning: lightmap block %dx%d doesn't fit into a %dx%d atlas\n", rects[i].w, rects[i].h, max_size, max_size);
+					rects[i].page = -1;
+				}
+				break;
+			}
+			left.resize(n);
+			pageCount++;
 		}
+		if (!pageCount)
+			pageCount = 1;
 	}
 
-	std::vector<RectI> unsorted_rects(rects.size());
+	std::pmr::vector<RectI> unsorted_rects(rects.size(), rects.get_allocator());
 	for (int i = 0; i < rects.size(); i++)
-		unsorted_rects[rects[i].id] = rects[i];
+	{
+		RectI &rect = unsorted_rects[rects[i].id];
+		rect = rects[i];
+		if (rect.w * rect.h != 0)
+		{
+			rect.x += padding;
+			rect.y += padding;
+			rect.w -= padding * 2;
+			rect.h -= padding * 2;
+		}
+	}
 
 	rects = std::move(unsorted_rects);
 
+	if (verbose)
+	{
+		const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		// rows up to the highest rect of the last page show how tight the packing is when sizes come out the same
+		int usedRows = 0;
+		for (const auto &rect : rects)
+		{
+			if (rect.page == pageCount - 1 && rect.w * rect.h != 0)
+				usedRows = std::max(usedRows, rect.y + rect.h + padding);
+		}
+		printf("Packed %zd lightmap rects into %dx%d, %d page(s), %.1f%% filled, %d rows used on the last page, %.2f ms\n", rects.size(), block_width, block_height, pageCount,
+			100.0 * area / ((double)block_width * block_height * pageCount), usedRows, ms);
+	}
+}
+
+uint64_t LightmapLayout::hash(const void *data, size_t size, uint64_t key)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		key ^= bytes[i];
+		key *= 1099511628211ull;
+	}
+	return key;
+}
+
+uint64_t LightmapLayout::hashOptions(const LoadConfig &config, uint64_t key)
+{
+	const int32_t options[] = { config.lightmapSize, (int)config.lightmapPacker, config.lightmapRotate, config.lightmapPadding,
+		config.lightmapScaleMin, config.mergeFaces, config.skipSky, config.staticBatching, config.areaBuffers, config.lightmapModelMin };
+	key = hash(options, sizeof(options), key);
+	return hash(&config.lightmapScale, sizeof(config.lightmapScale), key);
+}
+
+static const uint32_t LAYOUT_IDENT = ('Y' << 24) + ('L' << 16) + ('M' << 8) + 'L';
+static const uint32_t LAYOUT_VERSION = 1;
+
+bool LightmapLayout::save(const std::string &path) const
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Error: can't write %s: %s\n", path.c_str(), strerror(errno));
+		return false;
+	}
+
+	const uint32_t header[] = { LAYOUT_IDENT, LAYOUT_VERSION, (uint32_t)atlases.size(), (uint32_t)rects.size(), (uint32_t)faceAtlases.size() };
+	fwrite(header, sizeof(header), 1, f);
+	fwrite(&key, sizeof(key), 1, f);
+	for (const auto &atlas : atlases)
+	{
+		const int32_t a[] = { atlas.width, atlas.height, atlas.pages };
+		fwrite(a, sizeof(a), 1, f);
+	}
+	for (const auto &rect : rects)
+	{
+		const int32_t r[] = { rect.x, rect.y, rect.w, rect.h, rect.page, rect.rotated };
+		fwrite(r, sizeof(r), 1, f);
+	}
+	if (faceAtlases.size())
+		fwrite(faceAtlases.data(), faceAtlases.size() * sizeof(faceAtlases[0]), 1, f);
+	fclose(f);
+	return true;
+}
+
+bool LightmapLayout::load(const std::string &path, uint64_t key_, size_t faceCount)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f)
+		return false;
+
+	uint32_t header[5] = {};
+	uint64_t fileKey = 0;
+	if (fread(header, sizeof(header), 1, f) != 1 || fread(&fileKey, sizeof(fileKey), 1, f) != 1
+		|| header[0] != LAYOUT_IDENT || header[1] != LAYOUT_VERSION || fileKey != key_ || header[3] != faceCount
+		|| (header[4] && header[4] != faceCount))
+	{
+		fclose(f);
+		return false;
+	}
+
+	bool ok = true;
+	atlases.resize(header[2]);
+	for (auto &atlas : atlases)
+	{
+		int32_t a[3] = {};
+		ok = ok && fread(a, sizeof(a), 1, f) == 1;
+		atlas = { a[0], a[1], a[2] };
+	}
+	rects.resize(header[3]);
+	for (auto &rect : rects)
+	{
+		int32_t r[6] = {};
+		ok = ok && fread(r, sizeof(r), 1, f) == 1;
+		rect.x = r[0];
+		rect.y = r[1];
+		rect.w = r[2];
+		rect.h = r[3];
+		rect.page = r[4];
+		rect.rotated = r[5] != 0;
+	}
+	faceAtlases.resize(header[4]);
+	if (faceAtlases.size())
+		ok = ok && fread(faceAtlases.data(), faceAtlases.size() * sizeof(faceAtlases[0]), 1, f) == 1;
+	fclose(f);
+
+	// every rect must stay inside its atlas page
+	for (size_t i = 0; ok && i < rects.size(); i++)
+	{
+		const int ai = faceAtlases.size() ? faceAtlases[i] : 0;
+		const Lightmap::RectI &rect = rects[i];
+		if (ai < 0 || ai >= atlases.size())
+			ok = false;
+		else if (rect.w * rect.h != 0 && rect.page >= 0)
+			ok = rect.x >= 0 && rect.y >= 0 && rect.x + rect.w <= atlases[ai].width && rect.y + rect.h <= atlases[ai].height && rect.page < atlases[ai].pages;
+	}
+	if (!ok)
+	{
+		fprintf(stderr, "Error: %s is damaged\n", path.c_str());
+		return false;
+	}
+	key = key_;
 	return true;
 }
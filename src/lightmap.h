@@ -2,7 +2,10 @@
 #pragma once
 
 #include "texture.h"
+#include "config.h"
 #include <string>
+#include <vector>
+#include <memory_resource>
 
 class Lightmap
 {
@@ -15,24 +18,80 @@ public:
 		int h = 0;
 
 		int id = 0;
+		int page = 0;	// -1 if the rect is bigger than a page
+		bool rotated = false;	// w and h are swapped, luxel rows go down the atlas columns
 	};
 
-	Lightmap(int size, bool vecs = false, bool rgbexp_ = false) : 
-		block_width(size), block_height(size), haveVecs(vecs), rgbexp(rgbexp_){}
+	Lightmap(int size, bool vecs = false, bool rgbexp_ = false, eLightmapHdr hdr_ = eLightmapHdr::NONE) :
+		block_width(size), block_height(size), haveVecs(vecs), rgbexp(rgbexp_), hdr(rgbexp_ ? hdr_ : eLightmapHdr::NONE){}
 	void initBlock();
 	bool allocBlock(RectI &rectInOut);
-	void uploadBlock(const std::string &name, bool verbose);
+	bool allocSkyline(RectI &rectInOut);
+	// returns the paths of the written lightmap images, one per page
+	std::vector<std::string> uploadBlock(const std::string &name, bool verbose);
 
 	void write(const RectI &rect, uint8_t *data, uint8_t *dataVecs = nullptr);
+	// fills 'padding' texels around the written luxels from their nearest written neighbours
+	void dilate(int threads);
+	// same for any atlas, 'coverage' has a non zero byte for every texel with a luxel
+	static void dilate(Texture &atlas, const std::vector<uint8_t> &coverage, int radius, int threads);
 
-	bool pack(std::vector<RectI> &rects, int max_size);
+	// filters a w x h block of luxels into dw x dh. Scaled luxel j samples the source at x0 + j * xStep
+	// (in source luxels, clamped to the block), rows go the same way with y0 and yStep.
+	// RGB8 luxels are filtered as they are, rgbexp ones in linear space and encoded back
+	static void resample(const uint8_t *src, int w, int h, uint8_t *dst, int dw, int dh,
+		float x0, float xStep, float y0, float yStep, eLightmapFilter filter, bool rgbexp);
+
+	// rects that don't fit into one max_size atlas spill into more pages of max_size
+	void pack(std::pmr::vector<RectI> &rects, int max_size, bool verbose = false);
 
 	int block_width = 1024;
 	int block_height = 1024;
 	bool haveVecs = false;
 	bool rgbexp = false;
+	// encoding of rgbexp luxels in the atlas
+	eLightmapHdr hdr = eLightmapHdr::NONE;
+	eLightmapPacker packer = eLightmapPacker::SKYLINE;
+	bool allowRotation = false;
+	// texels kept free around every rect, so bilinear filtering, mips and block compression don't pick up the neighbours
+	int padding = 0;
 	std::vector<int> allocated;
-	int current_lightmap_texture = 0;
-	Texture buffer;
-	Texture bufferVecs;
+	// top edge of the placed rects, nodes cover the atlas width from left to right
+	struct skylineNode_t
+	{
+		int x, y, w;
+	};
+	std::vector<skylineNode_t> skyline;
+	int pageCount = 1;
+	std::vector<Texture> buffers;
+	std::vector<Texture> buffersVecs;
+	// per page, texels filled by write(). Only kept with padding
+	std::vector<std::vector<uint8_t> > coverage;
+};
+
+// packed lightmap layout of a map, saved next to the export by -lm_only. A map with new lighting
+// but the same geometry reuses it and only gets its atlases written again
+class LightmapLayout
+{
+public:
+	// FNV-1a, chained through 'key'
+	static uint64_t hash(const void *data, size_t size, uint64_t key = 14695981039346656037ull);
+	// mixes in the options that change the layout
+	static uint64_t hashOptions(const LoadConfig &config, uint64_t key);
+
+	bool save(const std::string &path) const;
+	// false if there is no layout for this key and face count
+	bool load(const std::string &path, uint64_t key, size_t faceCount);
+
+	struct atlas_t
+	{
+		int width = 0;
+		int height = 0;
+		int pages = 0;
+	};
+
+	uint64_t key = 0;
+	std::vector<atlas_t> atlases;
+	std::vector<Lightmap::RectI> rects;	// final rect of every face
+	std::vector<int> faceAtlases;	// atlas of every face, empty with a single atlas
 };
@@ -39,18 +39,29 @@ bool Map::load(const char *path, const char *name, LoadConfig *config)
 	fread(&ident, sizeof(ident), 1, f);
 	fseek(f, 0, SEEK_SET);
 
+	// one arena for all loads, so a batch of maps reuses the memory of the previous one
+	static LoadArena loadArena;
+	arena = &loadArena;
+
 	bool r = false;
 	switch (ident)
 	{
 	case HLBSP_VERSION:
 	case XTBSP_VERSION:
-		return load_hlbsp(f, name, config);
+		r = load_hlbsp(f, name, config);
+		break;
 	case VBSP_IDENT:
-		return load_vbsp(f, name, config);
+		r = load_vbsp(f, name, config);
+		break;
 	default:
 		fprintf(stderr, "Error: unknown bsp version %d (%c%c%c%c)\n", ident, (char)ident, char(ident>>8), char(ident >> 16), char(ident >> 24));
-		return false;
+		break;
 	}
 
-	return false;
+	if (config->verbose)
+		printf("Temporary memory: %zd KB, peak %zd KB\n", loadArena.used() / 1024, loadArena.peak() / 1024);
+	loadArena.reset();
+	arena = nullptr;
+
+	return r;
 }
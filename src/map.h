@@ -1,10 +1,12 @@
 // Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
 #pragma once
 
+#include <memory>
 #include <vector>
 #include "texture.h"
 #include "vector_math.h"
 #include "config.h"
+#include "arena.h"
 
 enum bspIdents
 {
@@ -42,6 +44,7 @@ public:
 		int offset;
 		int count;
 		int material;
+		int lightmap = 0;	// index in lightmaps
 	};
 	struct mesh_t
 	{
@@ -51,6 +54,7 @@ public:
 		int vertCount;
 		std::vector<submesh_t> submeshes;
 		std::string name;
+		int buffer = 0;	// index in bufferNames
 	};
 	struct model_t
 	{
@@ -58,6 +62,33 @@ public:
 		std::vector<mesh_t> dispMeshes;
 		std::vector<mesh_t> portalMeshes;
 		vec3_t position = { 0,0,0 };
+		bool isStatic = false;	// brush entity that never moves
+		bool batched = false;	// geometry was baked into the world model
+		int lightmap = -1;	// first page of the model atlas, -1 if the model uses the world atlas
+		int lightmapPages = 1;
+	};
+	struct areaPortal_t
+	{
+		int portalKey;
+		int otherArea;
+		int mesh = -1;	// index in portalMeshes of the world model
+	};
+	struct area_t
+	{
+		int buffer = -1;	// -1 if the area has no geometry of its own
+		int lightmap = -1;	// first page of the area atlas
+		int lightmapPages = 1;
+		std::vector<areaPortal_t> portals;
+	};
+	// compact atlas of one light style
+	struct lightstyle_t
+	{
+		int style = 0;
+		std::string image;
+		int width = 0;
+		int height = 0;
+		// x, y, w, h of a block in the main atlas and x, y of its copy in this atlas, in luxels
+		std::vector<int> blocks;
 	};
 	struct material_t
 	{
@@ -69,19 +100,34 @@ public:
 
 	std::vector<vert_t> vertices;
 	std::vector<dispVert_t> dispVertices;
+	std::vector<vec3_t> portalVertices;
 	std::vector<uint16_t> indices16;
 	std::vector<uint32_t> indices32;
 	// model can contain multiple meshes
 	std::vector<model_t> models;
 	std::vector<Texture> textures;
 	std::vector<material_t> materials;
+	// lightmap atlas images, empty if the map has no lightmaps
+	std::vector<std::string> lightmaps;
+	std::vector<lightstyle_t> lightstyles;
+	// encoding of the lightmap images
+	eLightmapHdr lightmapHdr = eLightmapHdr::NONE;
+	// only the lightmap images were written from a cached layout, the rest of the export is up to date
+	bool lightmapsOnly = false;
+	// names of extra buffers, the first one is the main buffer
+	std::vector<std::string> bufferNames;
+	// source engine areas connected by area portals
+	std::vector<area_t> areas;
 
 private:
 	bool load_hlbsp(FILE *f, const char *name, LoadConfig *config = nullptr);
 	bool load_vbsp(FILE *f, const char *name, LoadConfig *config = nullptr);
 
-	void hlbsp_loadTextures(FILE *f, int fileofs, int filelen, std::vector<WadFile> &wads, bool verbose);
+	// namesOnly skips the pixels, names and sizes are enough to check a cached lightmap layout
+	void hlbsp_loadTextures(FILE *f, int fileofs, int filelen, std::vector<std::shared_ptr<const WadFile> > &wads, bool verbose, bool namesOnly = false);
 	void parseEntities(const char *src, size_t size);
 
 	std::vector<std::string> wadNames;
+	// backs the temporaries of the loaders while load() runs
+	LoadArena *arena = nullptr;
 };
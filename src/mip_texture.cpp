@@ -3,15 +3,18 @@
 #include "texture.h"
 #include "hlbsp.h"
 #include "wad.h"
+#include "cpu.h"
 #include <cstring>
 
-bool LoadMipTexture(const uint8_t *data, Texture &tex, int type)
+bool LoadMipTexture(const uint8_t *data, size_t size, Texture &tex, int type, int mip)
 {
 	hlbsp::mip_t texHeader;
 	bool hasAlpha = false;
 	int palOffset = 0;
 	if (type == WadFile::TYP_MIPTEX)
 	{
+		if (size < sizeof(texHeader))
+			return false;
 		memcpy(&texHeader, data, sizeof(texHeader));
 
 		if (texHeader.offsets[0] == 0)
@@ -19,49 +22,58 @@ bool LoadMipTexture(const uint8_t *data, Texture &tex, int type)
 
 		tex.name = texHeader.name;
 		hasAlpha = strchr(texHeader.name, '{') != nullptr;
-		palOffset = ((texHeader.width * texHeader.height * 85) >> 6) + sizeof(uint16_t);
+		// the palette follows the last mip, offsets are from the header start
+		palOffset = texHeader.offsets[0] + ((texHeader.width * texHeader.height * 85) >> 6) + sizeof(uint16_t);
+		if (mip > 0 && mip < hlbsp::MIPLEVELS)
+		{
+			if (texHeader.offsets[mip] == 0)
+				return false;
+			texHeader.offsets[0] = texHeader.offsets[mip];
+			texHeader.width >>= mip;
+			texHeader.height >>= mip;
+		}
 	}
 	else if (type == WadFile::TYP_GFXPIC)
 	{
+		if (size < 8)
+			return false;
 		memcpy(&texHeader.width, data, sizeof(int));
 		memcpy(&texHeader.height, data + 4, sizeof(int));
 		texHeader.offsets[0] = 8;
-		palOffset = texHeader.width * texHeader.height + sizeof(uint16_t);
+		palOffset = texHeader.offsets[0] + texHeader.width * texHeader.height + sizeof(uint16_t);
 	}
 	else
 	{
 		return false;
 	}
 
+	// lumps can be read straight from a mapped wad, nothing may be read past them
+	const uint64_t pixelCount = (uint64_t)texHeader.width * texHeader.height;
+	if (!texHeader.width || !texHeader.height || pixelCount > (1u << 26)
+		|| texHeader.offsets[0] + pixelCount > size || palOffset < 0 || (uint64_t)palOffset + 256 * 3 > size)
+		return false;
+
 	const uint8_t *ids = data + texHeader.offsets[0];
 	// two bytes before palette is a count of colors but it is always 256
-	const uint8_t *pal = ids + palOffset;
+	const uint8_t *pal = data + palOffset;
 
 	if (type == WadFile::TYP_GFXPIC && pal[255 * 3] == 0 && pal[255 * 3 + 1] == 0 && pal[255 * 3 + 2] == 255)
 		hasAlpha = true;
 
+	// 32bit palette with the transparent color already applied, the kernel only copies entries
+	uint32_t palette[256];
+	for (int i = 0; i < 256; i++)
+	{
+		uint8_t c[4] = { pal[i * 3 + 0], pal[i * 3 + 1], pal[i * 3 + 2], 255 };
+		if (hasAlpha && i == 255)
+			c[0] = c[1] = c[2] = c[3] = 0;
+		memcpy(&palette[i], c, sizeof(uint32_t));
+	}
+
 	tex.create(texHeader.width, texHeader.height, hasAlpha ? Texture::RGBA8 : Texture::RGB8);
-	uint8_t *dst = &tex.data[0];
 
 	// decode 8bit paletted texture into 24bit rgb or 32bit rgba
-	int len = texHeader.width * texHeader.height;
-	for (int j = 0; j < len; j++)
-	{
-		int col = ids[j] * 3;
-		dst[0] = pal[col + 0];
-		dst[1] = pal[col + 1];
-		dst[2] = pal[col + 2];
-		if (hasAlpha)
-		{
-			if (col == (255 * 3))
-				dst[0] = dst[1] = dst[2] = dst[3] = 0;
-			else
-				dst[3] = 255;
-			dst += 4;
-		}
-		else
-			dst += 3;
-	}
+	kernels().expandPalette(ids, (size_t)texHeader.width * texHeader.height, palette, &tex.data[0], hasAlpha ? 4 : 3);
 
 	return true;
 }
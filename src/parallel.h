@@ -0,0 +1,41 @@
+// Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+// calls func(i) for every i in [0, count) on up to 'threads' threads, 0 means all hardware threads.
+// Items are handed out in chunks in no particular order, so func must only write to its own data
+template<typename F>
+void parallelFor(int count, int threads, const F &func, int chunk = 64)
+{
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	threads = std::min(threads, (count + chunk - 1) / chunk);
+	if (threads <= 1)
+	{
+		for (int i = 0; i < count; i++)
+			func(i);
+		return;
+	}
+
+	std::atomic<int> next{ 0 };
+	auto worker = [&]()
+	{
+		for (int start = next.fetch_add(chunk); start < count; start = next.fetch_add(chunk))
+		{
+			int end = std::min(start + chunk, count);
+			for (int i = start; i < end; i++)
+				func(i);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int t = 1; t < threads; t++)
+		pool.emplace_back(worker);
+	worker();
+	for (auto &t : pool)
+		t.join();
+}
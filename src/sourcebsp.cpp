@@ -4,7 +4,14 @@
 #include <map>
 #include "map.h"
 #include "lightmap.h"
+#include "face_merge.h"
+#include "face_batch.h"
+#include "parallel.h"
+#include "cpu.h"
 #include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <tuple>
 #include <functional>
 #include <format>
 #include <cstring>
@@ -31,28 +38,28 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 		return false;
 	}
 
-	std::vector<char> entitiesText;
-	std::vector<bspTexData_t> texdatas;
-	std::vector<vec3_t> bspVertices;
-	std::vector<bspNode_t> bspNodes;
-	std::vector<bspTexInfo_t> texinfos;
-	std::vector<bspFace_t> faces;
-	std::vector<uint8_t> lightmapPixels;
-	std::vector<bspLeaf_v1_t> bspLeafs;
-	std::vector<uint16_t> edges;
-	std::vector<int32_t> surfedges;
-	std::vector<bspModel_t> bspModels;
-	std::vector<uint16_t> bspLeafFaces;
-	std::vector<bspDispInfo_t> dispInfos;
-	std::vector<vec3_t> normals;
-	std::vector<uint16_t> normalInds;
-	std::vector<bspDispVert_t> bspDispVerts;
-	std::vector<char> texDataStings;
-	std::vector<int> texDataStingTable;
-
-	std::vector<bspArea_t> bspAreas;
-	std::vector<bspAreaPortal_t> bspAreaPortals;
-	std::vector<vec3_t> bspAreaPortalVerts;
+	std::pmr::vector<char> entitiesText(arena);
+	std::pmr::vector<bspTexData_t> texdatas(arena);
+	std::pmr::vector<vec3_t> bspVertices(arena);
+	std::pmr::vector<bspNode_t> bspNodes(arena);
+	std::pmr::vector<bspTexInfo_t> texinfos(arena);
+	std::pmr::vector<bspFace_t> faces(arena);
+	std::pmr::vector<uint8_t> lightmapPixels(arena);
+	std::pmr::vector<bspLeaf_v1_t> bspLeafs(arena);
+	std::pmr::vector<uint16_t> edges(arena);
+	std::pmr::vector<int32_t> surfedges(arena);
+	std::pmr::vector<bspModel_t> bspModels(arena);
+	std::pmr::vector<uint16_t> bspLeafFaces(arena);
+	std::pmr::vector<bspDispInfo_t> dispInfos(arena);
+	std::pmr::vector<vec3_t> normals(arena);
+	std::pmr::vector<uint16_t> normalInds(arena);
+	std::pmr::vector<bspDispVert_t> bspDispVerts(arena);
+	std::pmr::vector<char> texDataStings(arena);
+	std::pmr::vector<int> texDataStingTable(arena);
+
+	std::pmr::vector<bspArea_t> bspAreas(arena);
+	std::pmr::vector<bspAreaPortal_t> bspAreaPortals(arena);
+	std::pmr::vector<vec3_t> bspAreaPortalVerts(arena);
 
 #define READ_LUMP(to, id) \
 	to.resize(header.lumps[id].size / sizeof(to[0])); \
@@ -67,20 +74,30 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 	READ_LUMP(bspVertices, LUMP_VERTEXES);
 	READ_LUMP(bspNodes, LUMP_NODES);
 	READ_LUMP(texinfos, LUMP_TEXINFO);
-	if (header.lumps[LUMP_LIGHTING].size || !header.lumps[LUMP_LIGHTING_HDR].size)
+	// hdr output takes the hdr lighting when the map has both
+	const bool hdrLighting = header.lumps[LUMP_LIGHTING_HDR].size && (!header.lumps[LUMP_LIGHTING].size || config->lightmapHdr != eLightmapHdr::NONE);
+	if (!hdrLighting)
 	{
 		READ_LUMP(faces, LUMP_FACES);
 		READ_LUMP(lightmapPixels, LUMP_LIGHTING);
 	}
 	else
 	{
-		READ_LUMP(faces, LUMP_FACES_HDR);
+		// maps without separate hdr faces keep the light offsets in the regular ones
+		if (header.lumps[LUMP_FACES_HDR].size)
+		{
+			READ_LUMP(faces, LUMP_FACES_HDR);
+		}
+		else
+		{
+			READ_LUMP(faces, LUMP_FACES);
+		}
 		READ_LUMP(lightmapPixels, LUMP_LIGHTING_HDR);
 	}
 
 	if(header.lumps[LUMP_LEAFS].version == 0)
 	{
-		std::vector<bspLeaf_v0_t> tempLeafs;
+		std::pmr::vector<bspLeaf_v0_t> tempLeafs(arena);
 		READ_LUMP(tempLeafs, LUMP_LEAFS);
 
 		bspLeafs.resize(tempLeafs.size());
@@ -143,7 +160,7 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 
 		{
 			std::map<int, std::pair<int, int>> leafAreas;
-			std::vector<int> faceToLeaf(faces.size(), -1);
+			std::pmr::vector<int> faceToLeaf(faces.size(), -1, arena);
 			int leafFaces = 0;
 			for (int i = 0; i < bspLeafs.size(); i++)
 			{
@@ -161,7 +178,7 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 		}
 	}
 
-	std::vector<int> faceAreas(faces.size(), -1);
+	std::pmr::vector<int> faceAreas(faces.size(), -1, arena);
 
 	models.resize(bspModels.size());
 	parseEntities(&entitiesText[0], entitiesText.size());
@@ -175,10 +192,9 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 		materials[i].lightmapped = (lightmapPixels.size() != 0);
 	}
 
-	std::vector<Lightmap::RectI> lmRects(faces.size());
-	std::vector<int> normalOffsets(faces.size());
+	std::pmr::vector<Lightmap::RectI> lmRects(faces.size(), arena);
+	std::pmr::vector<int> normalOffsets(faces.size(), arena);
 
-	Lightmap lightmap(config->lightmapSize, false, true);
 
 	int normalOffset = 0;
 	for (int mi = 0; mi < bspModels.size(); mi++)
@@ -262,58 +278,515 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 	if (config->scan)
 		return false;
 
-	if (lightmapPixels.size())
+	// bsp luxels are filtered down to a coarser grid in luxel space, the lighting lump keeps
+	// only the first lightmap of every face and is rebuilt with the new offsets
+	std::pmr::vector<float> lmScales(faces.size(), 1.0f, arena);
+	if (config->lightmapScale < 1 && lightmapPixels.size())
 	{
-		lightmap.pack(lmRects, config->lightmapSize);
-		lightmap.initBlock();
+		std::pmr::vector<Lightmap::RectI> lmSources(faces.size(), arena);
+		std::pmr::vector<vec2_t> lmSteps(faces.size(), arena);
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			bspFace_t &f = faces[fi];
+			Lightmap::RectI &rect = lmRects[fi];
+			if (rect.w * rect.h == 0)
+			{
+				f.lightOfs = -1;
+				continue;
+			}
+			lmSources[fi] = { f.lightmapMins[0], f.lightmapMins[1], rect.w, rect.h };
+			const int minW = std::min(config->lightmapScaleMin, rect.w);
+			const int minH = std::min(config->lightmapScaleMin, rect.h);
+			if (f.dispInfo != -1)
+			{
+				// displacement corners stay on the first and the last luxel
+				rect.w = std::max(minW, (int)ceilf((rect.w - 1) * config->lightmapScale) + 1);
+				rect.h = std::max(minH, (int)ceilf((rect.h - 1) * config->lightmapScale) + 1);
+				lmSteps[fi].x = rect.w > 1 ? (lmSources[fi].w - 1) / float(rect.w - 1) : 1.0f;
+				lmSteps[fi].y = rect.h > 1 ? (lmSources[fi].h - 1) / float(rect.h - 1) : 1.0f;
+			}
+			else
+			{
+				// the density doubles back until the face keeps the minimum size
+				const vec2i_t mins = { lmSources[fi].x, lmSources[fi].y };
+				const vec2i_t maxs = { mins.x + lmSources[fi].w - 1, mins.y + lmSources[fi].h - 1 };
+				float scale = config->lightmapScale;
+				while (true)
+				{
+					f.lightmapMins[0] = (int)floorf(mins.x * scale);
+					f.lightmapMins[1] = (int)floorf(mins.y * scale);
+					rect.w = (int)ceilf(maxs.x * scale) - f.lightmapMins[0] + 1;
+					rect.h = (int)ceilf(maxs.y * scale) - f.lightmapMins[1] + 1;
+					if (scale >= 1 || (rect.w >= minW && rect.h >= minH))
+						break;
+					scale = std::min(scale * 2, 1.0f);
+				}
+				lmScales[fi] = scale;
+				lmSteps[fi] = { 1.0f / scale, 1.0f / scale };
+			}
+			f.lightmapSize[0] = rect.w - 1;
+			f.lightmapSize[1] = rect.h - 1;
+		}
+
+		std::pmr::vector<uint32_t> scaledOfs(faces.size(), arena);
+		size_t scaledSize = 0;
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			if (faces[fi].lightOfs == -1)
+				continue;
+			scaledOfs[fi] = (uint32_t)scaledSize;
+			scaledSize += (size_t)lmRects[fi].w * lmRects[fi].h * 4;
+		}
+
+		std::pmr::vector<uint8_t> scaledPixels(scaledSize, arena);
+		parallelFor((int)faces.size(), config->threads, [&](int fi)
+		{
+			const bspFace_t &f = faces[fi];
+			if (f.lightOfs == -1)
+				return;
+			const Lightmap::RectI &src = lmSources[fi];
+			const Lightmap::RectI &rect = lmRects[fi];
+			// scaled luxel j lies at (mins + j) / scale in bsp luxels, displacements start at the first one
+			const float x0 = f.dispInfo != -1 ? 0.0f : f.lightmapMins[0] * lmSteps[fi].x - src.x;
+			const float y0 = f.dispInfo != -1 ? 0.0f : f.lightmapMins[1] * lmSteps[fi].y - src.y;
+			Lightmap::resample(&lightmapPixels[f.lightOfs], src.w, src.h, &scaledPixels[scaledOfs[fi]], rect.w, rect.h,
+				x0, lmSteps[fi].x, y0, lmSteps[fi].y, config->lightmapFilter, true);
+		}, 16);
+
+		if (config->verbose)
+			printf("Lightmap luxels scaled from %zd to %zd bytes\n", lightmapPixels.size(), scaledPixels.size());
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			if (faces[fi].lightOfs != -1)
+				faces[fi].lightOfs = scaledOfs[fi];
+		}
+		lightmapPixels.swap(scaledPixels);
 	}
 
-	int indOffset = 0;
-	for (int mi = 0; mi < bspModels.size(); mi++)
+	// join coplanar neighbours with the same texinfo and lightstyles, displacements stay as they are
+	std::vector<FaceMerger::polygon_t> mergedPolys;
+	std::pmr::vector<int> facePolys(faces.size(), -1, arena);
+	std::pmr::vector<vec2i_t> polyLmMins(arena);
+	std::pmr::vector<Lightmap::RectI> faceLmSizes(arena);
+	if (config->mergeFaces)
 	{
-		const bspModel_t &modIn = bspModels[mi];
+		FaceMerger merger(bspVertices.data());
+		int mergedCount = 0;
 
-		std::map<int, std::map<int, std::vector<int> > > areaMaterialFaces;
+		// lightmap extents of every face, merged polygons must fit in one block
+		std::pmr::vector<FaceMerger::luxelBounds_t> faceLuxels(faces.size(), arena);
+		for (size_t fi = 0; fi < faces.size(); fi++)
+		{
+			const vec2i_t mins = { faces[fi].lightmapMins[0], faces[fi].lightmapMins[1] };
+			faceLuxels[fi] = { mins, { mins.x + lmRects[fi].w, mins.y + lmRects[fi].h } };
+		}
+		auto acceptMerge = [&](const FaceMerger::polygon_t &poly)
+		{
+			return FaceMerger::acceptLuxelBounds(poly, faceLuxels.data());
+		};
 
-		for (uint32_t fi = modIn.firstFace; fi < modIn.firstFace + modIn.faceCount; fi++)
+		for (int mi = 0; mi < bspModels.size(); mi++)
+		{
+			const bspModel_t &modIn = bspModels[mi];
+			std::map<std::tuple<int, int, int, int, bool, uint32_t, float>, std::vector<FaceMerger::polygon_t> > groups;
+			for (uint32_t fi = modIn.firstFace; fi < modIn.firstFace + modIn.faceCount; fi++)
+			{
+				const bspFace_t &f = faces[fi];
+				const bspTexInfo_t &ti = texinfos[f.texInfo];
+				if ((config->skipSky && (ti.flags & SURF_SKY)) || f.dispInfo != -1)
+					continue;
+
+				uint32_t styles;
+				memcpy(&styles, f.styles, sizeof(styles));
+				FaceMerger::polygon_t poly;
+				poly.faces.push_back(fi);
+				for (int ei = 0; ei < f.edgesCount; ei++)
+				{
+					int se = surfedges[f.firstEdge + ei];
+					poly.corners.push_back({ (int)fi, ei, edges[abs(se) * 2 + (se > 0 ? 0 : 1)] });
+				}
+				groups[{faceAreas[fi] == -1 ? 0 : faceAreas[fi], f.planeNum, f.side, f.texInfo, lmRects[fi].w * lmRects[fi].h != 0, styles, lmScales[fi]}].push_back(std::move(poly));
+			}
+
+			for (auto &group : groups)
+			{
+				mergedCount += merger.merge(group.second, acceptMerge);
+				for (auto &poly : group.second)
+				{
+					if (poly.faces.size() == 1)
+						continue;
+					for (int fi : poly.faces)
+						facePolys[fi] = (int)mergedPolys.size();
+					mergedPolys.push_back(std::move(poly));
+				}
+			}
+		}
+
+		// pack a single block per polygon, sized to cover all of its faces
+		faceLmSizes = lmRects;
+		FaceMerger::fitLightmapRects(mergedPolys, faceLuxels.data(), lmRects, polyLmMins);
+
+		if (config->verbose)
+			printf("Merged %d faces into %d polygons\n", mergedCount + (int)mergedPolys.size(), (int)mergedPolys.size());
+	}
+
+	// bake faces of non-moving brush entities into the world
+	std::pmr::vector<int> faceBatchModels(arena);
+	if (config->staticBatching)
+	{
+		faceBatchModels.resize(faces.size(), 0);
+		int batchedCount = 0;
+		for (int mi = 1; mi < bspModels.size(); mi++)
+		{
+			if (!models[mi].isStatic)
+				continue;
+			const bspModel_t &modIn = bspModels[mi];
+			for (uint32_t fi = modIn.firstFace; fi < modIn.firstFace + modIn.faceCount; fi++)
+				faceBatchModels[fi] = mi;
+			models[mi].batched = true;
+			batchedCount++;
+		}
+		if (config->verbose)
+			printf("Batched %d static brush models into the world\n", batchedCount);
+	}
+
+	// in per-area mode every world area gets its own atlas and buffer, everything else stays in the first ones
+	std::pmr::vector<int> faceAtlases(faces.size(), 0, arena);
+	std::map<int, int> areaAtlases;
+	if (config->areaBuffers)
+	{
+		for (int fi = 0; fi < faces.size(); fi++)
+		{
+			bool world = (fi >= bspModels[0].firstFace && fi < bspModels[0].firstFace + bspModels[0].faceCount) || (faceBatchModels.size() && faceBatchModels[fi]);
+			int area = (faceAreas[fi] == -1) ? 0 : faceAreas[fi];
+			if (!world || area < 0)
+				continue;
+			faceAtlases[fi] = areaAtlases.emplace(area, (int)areaAtlases.size() + 1).first->second;
+		}
+	}
+
+	if (config->areaBuffers)
+	{
+		bufferNames.resize(areaAtlases.size() + 1);
+		for (auto &a : areaAtlases)
+			bufferNames[a.second] = std::format("area{}", a.first);
+	}
+
+	// with -lm_models every brush entity that can move gets its own atlas after the area ones, or shares one
+	// with the other small models
+	std::vector<std::string> atlasNames(1, name);
+	for (int i = 1; i < bufferNames.size(); i++)
+		atlasNames.push_back(std::format("{}_{}", name, bufferNames[i]));
+	if (config->lightmapModelMin >= 0 && lightmapPixels.size())
+	{
+		const size_t areaAtlasCount = atlasNames.size();
+		int sharedAtlas = -1;
+		for (int mi = 1; mi < bspModels.size(); mi++)
+		{
+			if (models[mi].batched)
+				continue;
+			const bspModel_t &m = bspModels[mi];
+			int64_t luxels = 0;
+			for (uint32_t fi = m.firstFace; fi < m.firstFace + m.faceCount; fi++)
+				luxels += (int64_t)lmRects[fi].w * lmRects[fi].h;
+			if (!luxels)
+				continue;
+			if (luxels < config->lightmapModelMin && sharedAtlas == -1)
+			{
+				sharedAtlas = (int)atlasNames.size();
+				atlasNames.push_back(std::format("{}_models", name));
+			}
+			int atlas = sharedAtlas;
+			if (luxels >= config->lightmapModelMin)
+			{
+				atlas = (int)atlasNames.size();
+				atlasNames.push_back(std::format("{}_model{}", name, mi));
+			}
+			for (uint32_t fi = m.firstFace; fi < m.firstFace + m.faceCount; fi++)
+				faceAtlases[fi] = atlas;
+			models[mi].lightmap = atlas;
+		}
+		if (config->verbose)
+			printf("Brush models take %d lightmap atlases\n", (int)(atlasNames.size() - areaAtlasCount));
+	}
+
+	if (config->areaBuffers || config->areaPortals)
+	{
+		areas.resize(bspAreas.size());
+		for (int ai = 0; ai < bspAreas.size(); ai++)
+		{
+			auto it = areaAtlases.find(ai);
+			areas[ai].buffer = areas[ai].lightmap = (it != areaAtlases.end()) ? it->second : -1;
+			for (uint32_t pi = bspAreas[ai].portalOffset; pi < bspAreas[ai].portalOffset + bspAreas[ai].portalsCount && pi < bspAreaPortals.size(); pi++)
+				areas[ai].portals.push_back({ bspAreaPortals[pi].portalKey, bspAreaPortals[pi].otherArea });
+		}
+	}
+
+	// -lm_only reuses the lightmap layout of the last conversion while the geometry, the light styles of faces,
+	// the areas and the lightmap options stay the same
+	LightmapLayout layout;
+	const std::string layoutPath = std::string(name) + ".lmlayout";
+	uint64_t layoutKey = 0;
+	bool layoutCached = false;
+	if (config->lightmapOnly && lightmapPixels.size())
+	{
+		layoutKey = LightmapLayout::hash(&header.version, sizeof(header.version));
+		layoutKey = LightmapLayout::hash(bspVertices.data(), bspVertices.size() * sizeof(bspVertices[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(edges.data(), edges.size() * sizeof(edges[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(surfedges.data(), surfedges.size() * sizeof(surfedges[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(texinfos.data(), texinfos.size() * sizeof(texinfos[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(dispInfos.data(), dispInfos.size() * sizeof(dispInfos[0]), layoutKey);
+		for (const auto &face : faces)
+		{
+			const int32_t fields[] = { face.planeNum, face.side, face.firstEdge, face.edgesCount, face.texInfo, face.dispInfo, face.lightOfs != -1 };
+			layoutKey = LightmapLayout::hash(fields, sizeof(fields), layoutKey);
+			layoutKey = LightmapLayout::hash(face.styles, sizeof(face.styles), layoutKey);
+		}
+		for (const auto &model : bspModels)
+		{
+			const uint32_t fields[] = { model.firstFace, model.faceCount };
+			layoutKey = LightmapLayout::hash(fields, sizeof(fields), layoutKey);
+		}
+		layoutKey = LightmapLayout::hash(faceAreas.data(), faceAreas.size() * sizeof(faceAreas[0]), layoutKey);
+		layoutKey = LightmapLayout::hash(faceAtlases.data(), faceAtlases.size() * sizeof(faceAtlases[0]), layoutKey);
+		layoutKey = LightmapLayout::hashOptions(*config, layoutKey);
+
+		layoutCached = layout.load(layoutPath, layoutKey, faces.size()) && layout.atlases.size() == atlasNames.size();
+		if (!layoutCached)
+			printf("Lightmap layout %s is missing or outdated, the map will be converted fully\n", layoutPath.c_str());
+		else if (config->verbose)
+			printf("Lightmap layout is taken from %s\n", layoutPath.c_str());
+	}
+
+	Lightmap atlasProto(config->lightmapSize, false, true, config->lightmapHdr);
+	atlasProto.packer = config->lightmapPacker;
+	atlasProto.allowRotation = config->lightmapRotate;
+	atlasProto.padding = config->lightmapPadding;
+	std::vector<Lightmap> atlases(atlasNames.size(), atlasProto);
+
+	// atlases are written after the geometry, or straight away with a cached layout
+	auto saveLightmaps = [&]()
+	{
+		if (lightmapPixels.empty())
+			return;
+		lightmapHdr = config->lightmapHdr;
+		for (int li = 0; li < atlases.size(); li++)
+		{
+			atlases[li].dilate(config->threads);
+			std::vector<std::string> pages = atlases[li].uploadBlock(atlasNames[li], config->verbose);
+			lightmaps.insert(lightmaps.end(), pages.begin(), pages.end());
+		}
+	};
+
+	if (lightmapPixels.size() && layoutCached)
+	{
+		lmRects.assign(layout.rects.begin(), layout.rects.end());
+		for (int li = 0; li < atlases.size(); li++)
+		{
+			atlases[li].block_width = layout.atlases[li].width;
+			atlases[li].block_height = layout.atlases[li].height;
+			atlases[li].pageCount = layout.atlases[li].pages;
+			atlases[li].initBlock();
+		}
+
+		// faces of a merged polygon share edge luxels, the first face writes all of them in order like the geometry pass
+		parallelFor((int)faces.size(), config->threads, [&](int face)
+		{
+			const int pi = facePolys[face];
+			if (pi != -1 && mergedPolys[pi].faces[0] != face)
+				return;
+			auto writeFace = [&](int fi)
+			{
+				if (faces[fi].lightOfs != -1 && lmRects[fi].w * lmRects[fi].h != 0)
+					atlases[faceAtlases[fi]].write(lmRects[fi], &lightmapPixels[faces[fi].lightOfs]);
+			};
+			if (pi != -1)
+			{
+				for (int fi : mergedPolys[pi].faces)
+					writeFace(fi);
+			}
+			else
+			{
+				writeFace(face);
+			}
+		}, 16);
+		saveLightmaps();
+		lightmapsOnly = true;
+		return true;
+	}
+	else if (lightmapPixels.size())
+	{
+		std::pmr::vector<Lightmap::RectI> atlasRects(arena);
+		for (int li = 0; li < atlases.size(); li++)
+		{
+			atlasRects.clear();
+			for (int fi = 0; fi < faces.size(); fi++)
+			{
+				if (faceAtlases[fi] == li)
+					atlasRects.push_back(lmRects[fi]);
+			}
+			if (atlasRects.size())
+				atlases[li].pack(atlasRects, config->lightmapSize, config->verbose);
+			for (int fi = 0, ri = 0; fi < faces.size(); fi++)
+			{
+				if (faceAtlases[fi] == li)
+					lmRects[fi] = atlasRects[ri++];
+			}
+			atlases[li].initBlock();
+			if (atlases[li].pageCount > 1 && config->verbose)
+				printf("Lightmap atlas %d takes %d pages\n", li, atlases[li].pageCount);
+		}
+	}
+
+	for (int li = 0; li < atlases.size(); li++)
+	{
+		if (atlases[li].pageCount > FaceBatches::MAX_PAGES)
+		{
+			fprintf(stderr, "Error: lightmap atlas %d takes %d pages, at most %d are supported, raise -lm\n", li, atlases[li].pageCount, FaceBatches::MAX_PAGES);
+			return false;
+		}
+	}
+
+	// atlas pages are consecutive lightmap images
+	std::pmr::vector<int> atlasFirstImage(atlases.size(), arena);
+	for (int li = 1; li < atlases.size(); li++)
+		atlasFirstImage[li] = atlasFirstImage[li - 1] + atlases[li - 1].pageCount;
+	for (auto &area : areas)
+	{
+		if (area.lightmap == -1)
+			continue;
+		area.lightmapPages = atlases[area.lightmap].pageCount;
+		area.lightmap = atlasFirstImage[area.lightmap];
+	}
+	for (auto &model : models)
+	{
+		if (model.lightmap == -1)
+			continue;
+		model.lightmapPages = atlases[model.lightmap].pageCount;
+		model.lightmap = atlasFirstImage[model.lightmap];
+	}
+
+	// every face of a merged polygon keeps its own luxels at an offset inside the polygon block
+	for (int pi = 0; pi < mergedPolys.size(); pi++)
+	{
+		const auto &poly = mergedPolys[pi];
+		const auto block = lmRects[poly.faces[0]];
+		for (int fi : poly.faces)
+		{
+			auto &rect = lmRects[fi];
+			rect = faceLmSizes[fi];
+			if (rect.w * rect.h == 0)
+				continue;
+			rect.page = block.page;
+			int dx = faces[fi].lightmapMins[0] - polyLmMins[pi].x;
+			int dy = faces[fi].lightmapMins[1] - polyLmMins[pi].y;
+			if (block.rotated)
+			{
+				std::swap(rect.w, rect.h);
+				std::swap(dx, dy);
+				rect.rotated = true;
+			}
+			rect.x = block.x + dx;
+			rect.y = block.y + dy;
+		}
+	}
+
+	if (config->lightmapOnly && lightmapPixels.size())
+	{
+		layout.key = layoutKey;
+		layout.atlases.clear();
+		for (const auto &atlas : atlases)
+			layout.atlases.push_back({ atlas.block_width, atlas.block_height, atlas.pageCount });
+		layout.rects.assign(lmRects.begin(), lmRects.end());
+		layout.faceAtlases.assign(faceAtlases.begin(), faceAtlases.end());
+		layout.save(layoutPath);
+	}
+
+	// merged polygons are triangulated first, the layout needs their index counts
+	std::pmr::vector<std::vector<int> > polyTriangles(mergedPolys.size(), arena);
+	parallelFor((int)mergedPolys.size(), config->threads, [&](int pi)
+	{
+		const auto &poly = mergedPolys[pi];
+		std::vector<vec3_t> points(poly.corners.size());
+		for (int ei = 0; ei < points.size(); ei++)
+		{
+			int cfi = poly.corners[ei].face;
+			points[ei] = bspVertices[poly.corners[ei].vertex];
+			if (faceBatchModels.size() && faceBatchModels[cfi])
+				points[ei] = points[ei] + models[faceBatchModels[cfi]].position;
+		}
+		FaceMerger::triangulate(points.data(), (int)points.size(), polyTriangles[pi]);
+	}, 16);
+
+	// the layout pass places every face in the vertex and index buffers, then faces are filled in parallel
+	struct faceJob_t
+	{
+		int face;
+		int vertOffset;	// in vertices or dispVertices
+		int indOffset;	// in indices32
+		int baseVertex;	// index of the first face vertex inside its mesh
+	};
+	std::pmr::vector<faceJob_t> faceJobs(arena);
+	std::pmr::vector<faceJob_t> dispJobs(arena);
+	std::pmr::vector<int> luxelFaces(arena);
+	int indOffset = (int)indices32.size();
+	int vertexCount = (int)vertices.size();
+	int dispVertexCount = (int)dispVertices.size();
+	// faces of batched models go into the world, after its own faces of the same area and material
+	FaceBatches batches(arena);
+	for (int mi = 0; mi < bspModels.size(); mi++)
+	{
+		const int outModel = models[mi].batched ? 0 : mi;
+		const bspModel_t &m = bspModels[mi];
+		for (uint32_t fi = m.firstFace; fi < m.firstFace + m.faceCount; fi++)
 		{
 			const bspFace_t &f = faces[fi];
 			const bspTexInfo_t &ti = texinfos[f.texInfo];
 			if (config->skipSky && (ti.flags & SURF_SKY))
 				continue;
+			// merged polygons are emitted by their first face
+			if (facePolys[fi] != -1 && mergedPolys[facePolys[fi]].faces[0] != fi)
+				continue;
 			int area = faceAreas[fi];
 			if (area == -1)
 				area = 0;
-			areaMaterialFaces[area][ti.texData].push_back(fi);
+			batches.add(outModel, area, std::max(lmRects[fi].page, 0), ti.texData, fi, mi);
 		}
+	}
+	batches.sort();
+
+	for (size_t modelBegin = 0, modelEnd; modelBegin < batches.entries.size(); modelBegin = modelEnd)
+	{
+		const int mi = batches.model(modelBegin);
+		modelEnd = batches.runEnd(modelBegin, FaceBatches::MODEL_BITS);
 
-		for (auto &area : areaMaterialFaces)
+		for (size_t areaBegin = modelBegin, areaEnd; areaBegin < modelEnd; areaBegin = areaEnd)
 		{
+			areaEnd = batches.runEnd(areaBegin, FaceBatches::GROUP_BITS);
+			const int areaId = batches.group(areaBegin);
 			bool hasDisp = false;
 
 			models[mi].meshes.push_back({});
 			mesh_t &mesh = models[mi].meshes.back();
-			mesh.name = (area.first == -2) ? "area_mixed" : std::format("area_{}", area.first);
-			mesh.vertOffset = (int)vertices.size();
+			mesh.name = (areaId == -2) ? "area_mixed" : std::format("area_{}", areaId);
+			mesh.buffer = (mi == 0 && areaAtlases.count(areaId)) ? areaAtlases[areaId] : 0;
+			mesh.vertOffset = vertexCount;
 			mesh.offset = indOffset;
 			int curV = 0;
-			for (auto &mat : area.second)
+			for (size_t matBegin = areaBegin, matEnd; matBegin < areaEnd; matBegin = matEnd)
 			{
+				matEnd = batches.runEnd(matBegin, FaceBatches::MATERIAL_BITS);
 				submesh_t submesh{ 0 };
-				submesh.material = mat.first;
+				submesh.material = batches.material(matBegin);
 				submesh.offset = indOffset;
+				submesh.lightmap = atlasFirstImage[faceAtlases[batches.entries[matBegin].face]] + batches.page(matBegin);
 
-				for (int i = 0; i < mat.second.size(); i++)
+				for (size_t ei = matBegin; ei < matEnd; ei++)
 				{
-					const bspFace_t &f = faces[mat.second[i]];
-					const bspTexInfo_t &ti = texinfos[f.texInfo];
-					const bspTexData_t &td = texdatas[ti.texData];
-					Lightmap::RectI &rect = lmRects[mat.second[i]];
-
-					if (f.lightOfs != -1 && lightmapPixels.size())
-					{
-						lightmap.write(rect, &lightmapPixels[f.lightOfs]);
-					}
+					const int face = batches.entries[ei].face;
+					const bspFace_t &f = faces[face];
+					const int pi = facePolys[face];
+					luxelFaces.push_back(face);
 
 					if (f.dispInfo != -1)
 					{
@@ -321,31 +794,13 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 						continue;
 					}
 
-					for (int ei = 0; ei < f.edgesCount; ei++)
-					{
-						int se = surfedges[f.firstEdge + ei];
-						int v = edges[abs(se) * 2 + (se > 0 ? 0 : 1)];
-
-						vert_t vert{};
-						vert.pos = bspVertices[v];
-						vert.norm = normals[normalInds[normalOffsets[mat.second[i]] + ei]];
-						vert.uv = { (vert.pos.dot(ti.textureVecS) + ti.textureOffS) / td.width, (vert.pos.dot(ti.textureVecT) + ti.textureOffT) / td.height };
-						if (f.lightOfs != -1) {
-							vert.uv2.x = (vert.pos.dot(ti.lightmapVecS) + ti.lightmapOffS + 0.5f - f.lightmapMins[0] + rect.x) / lightmap.block_width;
-							vert.uv2.y = (vert.pos.dot(ti.lightmapVecT) + ti.lightmapOffT + 0.5f - f.lightmapMins[1] + rect.y) / lightmap.block_height;
-						}
-						vertices.push_back(vert);
-					}
-
-					for (int ei = 0; ei < f.edgesCount - 2; ei++)
-					{
-						indices32.push_back(curV);
-						indices32.push_back(curV + ei + 2);
-						indices32.push_back(curV + ei + 1);
-					}
-					curV += f.edgesCount;
-					submesh.count += (f.edgesCount - 2) * 3;
-					indOffset += (f.edgesCount - 2) * 3;
+					const int numVerts = (pi != -1) ? (int)mergedPolys[pi].corners.size() : f.edgesCount;
+					const int triInds = (pi != -1) ? (int)polyTriangles[pi].size() : (f.edgesCount - 2) * 3;
+					faceJobs.push_back({ face, vertexCount, indOffset, curV });
+					vertexCount += numVerts;
+					curV += numVerts;
+					submesh.count += triInds;
+					indOffset += triInds;
 				}
 				if (submesh.count)
 				{
@@ -360,188 +815,37 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 
 			models[mi].dispMeshes.push_back({});
 			mesh_t &dmesh = models[mi].dispMeshes.back();
-			dmesh.name = (area.first == -2) ? "disp_area_mixed" : std::format("disp_area_{}", area.first);
-			dmesh.vertOffset = (int)dispVertices.size();
+			dmesh.name = (areaId == -2) ? "disp_area_mixed" : std::format("disp_area_{}", areaId);
+			dmesh.buffer = mesh.buffer;
+			dmesh.vertOffset = dispVertexCount;
 			dmesh.offset = indOffset;
 			curV = 0;
 
-			for (auto &mat : area.second)
+			for (size_t matBegin = areaBegin, matEnd; matBegin < areaEnd; matBegin = matEnd)
 			{
+				matEnd = batches.runEnd(matBegin, FaceBatches::MATERIAL_BITS);
 				submesh_t submesh{ 0 };
-				submesh.material = mat.first;
+				submesh.material = batches.material(matBegin);
 				submesh.offset = indOffset;
+				submesh.lightmap = atlasFirstImage[faceAtlases[batches.entries[matBegin].face]] + batches.page(matBegin);
 
-				for (int i = 0; i < mat.second.size(); i++)
+				for (size_t ei = matBegin; ei < matEnd; ei++)
 				{
-					const bspFace_t &f = faces[mat.second[i]];
+					const int face = batches.entries[ei].face;
+					const bspFace_t &f = faces[face];
 
 					if (f.dispInfo == -1)
 						continue;
-					const bspTexInfo_t &ti = texinfos[f.texInfo];
-					const bspTexData_t &td = texdatas[ti.texData];
-					const Lightmap::RectI &rect = lmRects[mat.second[i]];
-					const bspDispInfo_t &di = dispInfos[f.dispInfo];
 
 					if (f.edgesCount > 4)
 					{
-						fprintf(stderr, "Error: unexpected edge count (%d) on face %d with displacement %d\n", f.edgesCount, mat.second[i], f.dispInfo);
+						fprintf(stderr, "Error: unexpected edge count (%d) on face %d with displacement %d\n", f.edgesCount, face, f.dispInfo);
 						continue;
 					}
-					vert_t tempVerts[4];
-					int vertIdShift = 0;
-					float nearestDist = FLT_MAX;
-					for (int ei = 0; ei < f.edgesCount; ei++)
-					{
-						int se = surfedges[f.firstEdge + ei];
-						int v = edges[abs(se) * 2 + (se > 0 ? 0 : 1)];
-
-						vert_t &vert = tempVerts[ei];
-						vert.pos = bspVertices[v];
-						vert.norm = normals[normalInds[normalOffsets[mat.second[i]] + ei]];
-						vert.uv = { (vert.pos.dot(ti.textureVecS) + ti.textureOffS) / td.width, (vert.pos.dot(ti.textureVecT) + ti.textureOffT) / td.height };
-
-						float dist = di.startPos.dist2(vert.pos);
-						if (dist < nearestDist) {
-							nearestDist = dist;
-							vertIdShift = ei;
-						}
-					}
-
-					int i0 = vertIdShift;
-					int i1 = (vertIdShift + 1) % 4;
-					int i2 = (vertIdShift + 2) % 4;
-					int i3 = (vertIdShift + 3) % 4;
-					if (f.lightOfs != -1)
-					{
-						tempVerts[i0].uv2 = { (rect.x + 0.5f) / lightmap.block_width, (rect.y + 0.5f) / lightmap.block_height };
-						tempVerts[i1].uv2 = { (rect.x + 0.5f) / lightmap.block_width, (rect.y + rect.h - 0.5f) / lightmap.block_height };
-						tempVerts[i2].uv2 = { (rect.x + rect.w - 0.5f) / lightmap.block_width, (rect.y + rect.h - 0.5f) / lightmap.block_height };
-						tempVerts[i3].uv2 = { (rect.x + rect.w - 0.5f) / lightmap.block_width, (rect.y + 0.5f) / lightmap.block_height };
-					}
-
-					int width = (1 << di.power) + 1;
-					for (int y = 0; y < width; y++)
-					{
-						float yf = y / (float)(width - 1);
-						vec3_t posy1 = vec3_t::lerp(tempVerts[i0].pos, tempVerts[i1].pos, yf);
-						vec3_t posy2 = vec3_t::lerp(tempVerts[i3].pos, tempVerts[i2].pos, yf);
-						vec2_t uvy1 = vec2_t::lerp(tempVerts[i0].uv, tempVerts[i1].uv, yf);
-						vec2_t uvy2 = vec2_t::lerp(tempVerts[i3].uv, tempVerts[i2].uv, yf);
-						vec2_t lmuvy1 = vec2_t::lerp(tempVerts[i0].uv2, tempVerts[i1].uv2, yf);
-						vec2_t lmuvy2 = vec2_t::lerp(tempVerts[i3].uv2, tempVerts[i2].uv2, yf);
-
-						int vo = di.dispVertOffset + y * width;
-						for (int x = 0; x < width; x++)
-						{
-							float xf = x / (float)(width - 1);
-							bspDispVert_t &dv = bspDispVerts[vo + x];
-
-							dispVert_t vert;
-							vert.pos = vec3_t::lerp(posy1, posy2, xf);
-							vert.pos = { vert.pos.x + dv.vector.x * dv.dist, vert.pos.y + dv.vector.y * dv.dist, vert.pos.z + dv.vector.z * dv.dist };
-							vert.uv = vec2_t::lerp(uvy1, uvy2, xf);
-							vert.uv2 = vec2_t::lerp(lmuvy1, lmuvy2, xf);
-							vert.color = { 1.0f, 1.0f, 1.0f };
-							vert.alpha = dv.alpha / 255.0f;
-							dispVertices.push_back(vert);
-						}
-					}
-
-					// normals
-					int cv = curV;
-					for (int y = 0; y < width; y++)
-					{
-						for (int x = 0; x < width; x++)
-						{
-							auto rpos = [&](int dx, int dy)
-							{
-								return dispVertices[cv + (y + dy) * width + x + dx].pos;
-							};
-
-							dispVert_t &vert = dispVertices[cv + y * width + x];
-							vec3_t norm{ 0.0f,0.0f,0.0f };
-							int n = 0;
-							if (y + 1 < width && x + 1 < width)
-							{
-								vec3_t v0 = rpos(0, 1) - vert.pos;
-								vec3_t v1 = rpos(1, 0) - vert.pos;
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-
-								v0 = rpos(0, 1) - rpos(1, 0);
-								v1 = rpos(1, 1) - rpos(1, 0);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-							}
-
-							if (x > 0 && y + 1 < width)
-							{
-								vec3_t v0 = rpos(-1, 1) - rpos(-1, 0);
-								vec3_t v1 = vert.pos - rpos(-1, 0);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-
-								v0 = rpos(-1, 1) - vert.pos;
-								v1 = rpos(0, 1) - vert.pos;
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-							}
-
-							if (x > 0 && y > 0)
-							{
-								vec3_t v0 = rpos(-1, 0) - rpos(-1, -1);
-								vec3_t v1 = rpos(0, -1) - rpos(-1, -1);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-
-								v0 = rpos(-1, 0) - rpos(0, -1);
-								v1 = vert.pos - rpos(0, -1);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-							}
-
-							if (x + 1 < width && y > 0)
-							{
-								vec3_t v0 = vert.pos - rpos(0, -1);
-								vec3_t v1 = rpos(1, -1) - rpos(0, -1);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-
-								v0 = vert.pos - rpos(1, -1);
-								v1 = rpos(1, 0) - rpos(1, -1);
-								norm = norm + v1.cross(v0).normalize();
-								n++;
-							}
-
-							norm *= (1.0f / n);
-							vert.norm = norm;
-						}
-					}
-
-					cv = curV;
-					for (int y = 0; y < width - 1; y++) {
-						for (int x = 0; x < width - 1; x++) {
-							if ((cv - curV) % 2) {
-								indices32.push_back(cv);
-								indices32.push_back(cv + 1);
-								indices32.push_back(cv + width);
-								indices32.push_back(cv + 1);
-								indices32.push_back(cv + width + 1);
-								indices32.push_back(cv + width);
-							}
-							else {
-								indices32.push_back(cv);
-								indices32.push_back(cv + width + 1);
-								indices32.push_back(cv + width);
-								indices32.push_back(cv);
-								indices32.push_back(cv + 1);
-								indices32.push_back(cv + width + 1);
-							}
-							cv++;
-						}
-						cv++;
-					}
 
+					int width = (1 << dispInfos[f.dispInfo].power) + 1;
+					dispJobs.push_back({ face, dispVertexCount, indOffset, curV });
+					dispVertexCount += width * width;
 					curV += width * width;
 					submesh.count += (width - 1) * (width - 1) * 6;
 					indOffset += (width - 1) * (width - 1) * 6;
@@ -556,8 +860,255 @@ bool Map::load_vbsp(FILE *f, const char *name, LoadConfig *config)
 		}
 	}
 
-	if(lightmapPixels.size())
-		lightmap.uploadBlock(name, config->verbose);
+	vertices.resize(vertexCount);
+	dispVertices.resize(dispVertexCount);
+	indices32.resize(indOffset);
+
+	// face rects never overlap, so faces can write their luxels concurrently
+	parallelFor((int)luxelFaces.size(), config->threads, [&](int li)
+	{
+		const int face = luxelFaces[li];
+		const bspFace_t &f = faces[face];
+		if (f.lightOfs == -1 || !lightmapPixels.size())
+			return;
+		if (facePolys[face] != -1)
+		{
+			for (int fi : mergedPolys[facePolys[face]].faces)
+				atlases[faceAtlases[fi]].write(lmRects[fi], &lightmapPixels[faces[fi].lightOfs]);
+		}
+		else
+		{
+			atlases[faceAtlases[face]].write(lmRects[face], &lightmapPixels[f.lightOfs]);
+		}
+	}, 16);
+
+	parallelFor((int)faceJobs.size(), config->threads, [&](int ji)
+	{
+		const faceJob_t &job = faceJobs[ji];
+		const bspFace_t &f = faces[job.face];
+		const bspTexInfo_t &ti = texinfos[f.texInfo];
+		const bspTexData_t &td = texdatas[ti.texData];
+		const int pi = facePolys[job.face];
+		const FaceMerger::polygon_t *poly = (pi != -1) ? &mergedPolys[pi] : nullptr;
+
+		const int numVerts = poly ? (int)poly->corners.size() : f.edgesCount;
+		for (int ei = 0; ei < numVerts; ei++)
+		{
+			// all faces of a polygon share the luxel grid, so any of them gives the same result
+			int cfi = job.face;
+			int corner = ei;
+			int v;
+			if (poly)
+			{
+				cfi = poly->corners[ei].face;
+				corner = poly->corners[ei].index;
+				v = poly->corners[ei].vertex;
+			}
+			else
+			{
+				int se = surfedges[f.firstEdge + ei];
+				v = edges[abs(se) * 2 + (se > 0 ? 0 : 1)];
+			}
+			const bspFace_t &cf = faces[cfi];
+			const Lightmap::RectI &crect = lmRects[cfi];
+			const Lightmap &lightmap = atlases[faceAtlases[cfi]];
+
+			vert_t vert{};
+			vert.pos = bspVertices[v];
+			vert.norm = normals[normalInds[normalOffsets[cfi] + corner]];
+			vert.uv = { (vert.pos.dot(ti.textureVecS) + ti.textureOffS) / td.width, (vert.pos.dot(ti.textureVecT) + ti.textureOffT) / td.height };
+			if (f.lightOfs != -1) {
+				const float scale = lmScales[cfi];
+				float ls = (vert.pos.dot(ti.lightmapVecS) + ti.lightmapOffS) * scale + 0.5f - cf.lightmapMins[0];
+				float lt = (vert.pos.dot(ti.lightmapVecT) + ti.lightmapOffT) * scale + 0.5f - cf.lightmapMins[1];
+				if (crect.rotated)
+					std::swap(ls, lt);
+				vert.uv2.x = (ls + crect.x) / lightmap.block_width;
+				vert.uv2.y = (lt + crect.y) / lightmap.block_height;
+			}
+			if (faceBatchModels.size() && faceBatchModels[cfi])
+				vert.pos = vert.pos + models[faceBatchModels[cfi]].position;
+			vertices[job.vertOffset + ei] = vert;
+		}
+
+		uint32_t *inds = &indices32[job.indOffset];
+		if (poly)
+		{
+			const auto &polyTris = polyTriangles[pi];
+			for (int t = 0; t < polyTris.size(); t += 3)
+			{
+				*inds++ = job.baseVertex + polyTris[t];
+				*inds++ = job.baseVertex + polyTris[t + 2];
+				*inds++ = job.baseVertex + polyTris[t + 1];
+			}
+		}
+		else
+		{
+			for (int ei = 0; ei < f.edgesCount - 2; ei++)
+			{
+				*inds++ = job.baseVertex;
+				*inds++ = job.baseVertex + ei + 2;
+				*inds++ = job.baseVertex + ei + 1;
+			}
+		}
+	});
+
+	parallelFor((int)dispJobs.size(), config->threads, [&](int ji)
+	{
+		const faceJob_t &job = dispJobs[ji];
+		const bspFace_t &f = faces[job.face];
+		const bspTexInfo_t &ti = texinfos[f.texInfo];
+		const bspTexData_t &td = texdatas[ti.texData];
+		const Lightmap::RectI &rect = lmRects[job.face];
+		const bspDispInfo_t &di = dispInfos[f.dispInfo];
+		const Lightmap &lightmap = atlases[faceAtlases[job.face]];
+
+		vert_t tempVerts[4]{};
+		int vertIdShift = 0;
+		float nearestDist = FLT_MAX;
+		for (int ei = 0; ei < f.edgesCount; ei++)
+		{
+			int se = surfedges[f.firstEdge + ei];
+			int v = edges[abs(se) * 2 + (se > 0 ? 0 : 1)];
+
+			vert_t &vert = tempVerts[ei];
+			vert.pos = bspVertices[v];
+			vert.norm = normals[normalInds[normalOffsets[job.face] + ei]];
+			vert.uv = { (vert.pos.dot(ti.textureVecS) + ti.textureOffS) / td.width, (vert.pos.dot(ti.textureVecT) + ti.textureOffT) / td.height };
+
+			float dist = di.startPos.dist2(vert.pos);
+			if (dist < nearestDist) {
+				nearestDist = dist;
+				vertIdShift = ei;
+			}
+		}
+
+		int i0 = vertIdShift;
+		int i1 = (vertIdShift + 1) % 4;
+		int i2 = (vertIdShift + 2) % 4;
+		int i3 = (vertIdShift + 3) % 4;
+		if (f.lightOfs != -1)
+		{
+			// corners in luxels of the face, a rotated rect swaps them
+			const float lw = (rect.rotated ? rect.h : rect.w) - 0.5f;
+			const float lh = (rect.rotated ? rect.w : rect.h) - 0.5f;
+			auto luxelUv = [&](float s, float t)
+			{
+				if (rect.rotated)
+					std::swap(s, t);
+				return vec2_t{ (rect.x + s) / lightmap.block_width, (rect.y + t) / lightmap.block_height };
+			};
+			tempVerts[i0].uv2 = luxelUv(0.5f, 0.5f);
+			tempVerts[i1].uv2 = luxelUv(0.5f, lh);
+			tempVerts[i2].uv2 = luxelUv(lw, lh);
+			tempVerts[i3].uv2 = luxelUv(lw, 0.5f);
+		}
+
+		dispVert_t *dispVerts = &dispVertices[job.vertOffset];
+		int width = (1 << di.power) + 1;
+		for (int y = 0; y < width; y++)
+		{
+			float yf = y / (float)(width - 1);
+			vec3_t posy1 = vec3_t::lerp(tempVerts[i0].pos, tempVerts[i1].pos, yf);
+			vec3_t posy2 = vec3_t::lerp(tempVerts[i3].pos, tempVerts[i2].pos, yf);
+			vec2_t uvy1 = vec2_t::lerp(tempVerts[i0].uv, tempVerts[i1].uv, yf);
+			vec2_t uvy2 = vec2_t::lerp(tempVerts[i3].uv, tempVerts[i2].uv, yf);
+			vec2_t lmuvy1 = vec2_t::lerp(tempVerts[i0].uv2, tempVerts[i1].uv2, yf);
+			vec2_t lmuvy2 = vec2_t::lerp(tempVerts[i3].uv2, tempVerts[i2].uv2, yf);
+
+			int vo = di.dispVertOffset + y * width;
+			for (int x = 0; x < width; x++)
+			{
+				float xf = x / (float)(width - 1);
+				bspDispVert_t &dv = bspDispVerts[vo + x];
+
+				dispVert_t &vert = dispVerts[y * width + x];
+				vert.pos = vec3_t::lerp(posy1, posy2, xf);
+				vert.pos = { vert.pos.x + dv.vector.x * dv.dist, vert.pos.y + dv.vector.y * dv.dist, vert.pos.z + dv.vector.z * dv.dist };
+				vert.uv = vec2_t::lerp(uvy1, uvy2, xf);
+				vert.uv2 = vec2_t::lerp(lmuvy1, lmuvy2, xf);
+				vert.color = { 1.0f, 1.0f, 1.0f };
+				vert.alpha = dv.alpha / 255.0f;
+			}
+		}
+
+		// normals
+		thread_local std::vector<float> normalScratch;
+		normalScratch.resize((size_t)width * width * 9);
+		kernels().dispNormals(&dispVerts[0].pos, &dispVerts[0].norm, sizeof(dispVert_t), width, normalScratch.data());
+
+		uint32_t *inds = &indices32[job.indOffset];
+		int cv = job.baseVertex;
+		for (int y = 0; y < width - 1; y++) {
+			for (int x = 0; x < width - 1; x++) {
+				if ((cv - job.baseVertex) % 2) {
+					*inds++ = cv;
+					*inds++ = cv + 1;
+					*inds++ = cv + width;
+					*inds++ = cv + 1;
+					*inds++ = cv + width + 1;
+					*inds++ = cv + width;
+				}
+				else {
+					*inds++ = cv;
+					*inds++ = cv + width + 1;
+					*inds++ = cv + width;
+					*inds++ = cv;
+					*inds++ = cv + 1;
+					*inds++ = cv + width + 1;
+				}
+				cv++;
+			}
+			cv++;
+		}
+	});
+
+	if (config->areaPortals)
+	{
+		// both sides of a portal share the key and the polygon, make one mesh per key
+		std::map<int, int> portalMeshIds;
+		std::vector<int> polyTris;
+		for (const auto &portal : bspAreaPortals)
+		{
+			if (portal.vertsCount < 3 || portal.vertOffset + portal.vertsCount > bspAreaPortalVerts.size())
+				continue;
+			if (portalMeshIds.count(portal.portalKey))
+				continue;
+
+			polyTris.clear();
+			FaceMerger::triangulate(&bspAreaPortalVerts[portal.vertOffset], portal.vertsCount, polyTris);
+			if (!polyTris.size())
+				continue;
+
+			mesh_t mesh;
+			mesh.offset = (int)indices32.size();
+			mesh.count = (int)polyTris.size();
+			mesh.vertOffset = (int)portalVertices.size();
+			mesh.vertCount = portal.vertsCount;
+			mesh.name = std::format("portal_{}", portal.portalKey);
+			mesh.submeshes.push_back({ mesh.offset, mesh.count, -1 });
+			indices32.insert(indices32.end(), polyTris.begin(), polyTris.end());
+			portalVertices.insert(portalVertices.end(), bspAreaPortalVerts.begin() + portal.vertOffset, bspAreaPortalVerts.begin() + portal.vertOffset + portal.vertsCount);
+
+			portalMeshIds[portal.portalKey] = (int)models[0].portalMeshes.size();
+			models[0].portalMeshes.push_back(mesh);
+		}
+
+		for (auto &area : areas)
+		{
+			for (auto &portal : area.portals)
+			{
+				auto it = portalMeshIds.find(portal.portalKey);
+				if (it != portalMeshIds.end())
+					portal.mesh = it->second;
+			}
+		}
+
+		if (config->verbose)
+			printf("Area portal meshes: %zd\n", models[0].portalMeshes.size());
+	}
+
+	saveLightmaps();
 
 	return true;
 }
@@ -25,7 +25,7 @@ void Texture::create(int w, int h, Format fmt)
 	width = w;
 	height = h;
 	format = fmt;
-	int bpp = (format == RGB8 ? 3 : 4);
+	int bpp = pixelSize();
 	data.resize(w * h * bpp);
 }
 
@@ -37,25 +37,91 @@ void Texture::clearColor()
 
 void Texture::get(int x, int y, uint8_t *color)
 {
-	int bpp = (format == RGB8 ? 3 : 4);
+	int bpp = pixelSize();
 	int offs = (y * width + x) * bpp;
 	memcpy(color, &data[offs], bpp);
 }
 
 uint8_t *Texture::get(int x, int y)
 {
-	int bpp = (format == RGB8 ? 3 : 4);
+	int bpp = pixelSize();
 	int offs = (y * width + x) * bpp;
 	return &data[offs];
 }
 
 void Texture::set(int x, int y, uint8_t *color)
 {
-	int bpp = (format == RGB8 ? 3 : 4);
+	int bpp = pixelSize();
 	int offs = (y * width + x) * bpp;
 	memcpy(&data[offs], color, bpp);
 }
 
+int Texture::pixelSize() const
+{
+	if (format == RGB8)
+		return 3;
+	if (format == RGBA16F)
+		return 8;
+	return 4;
+}
+
+// single level uncompressed KTX2 with a basic data format descriptor, see the Khronos KTX 2.0 spec
+static bool writeKtx2(const char *path, int width, int height, const uint8_t *data)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f)
+		return false;
+
+	const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+	const uint32_t VK_FORMAT_R16G16B16A16_SFLOAT = 97;
+	const uint32_t headerSize = 12 + 9 * 4 + 4 * 4 + 2 * 8 + 3 * 8;
+	const uint32_t samples = 4;
+	const uint32_t dfdSize = 4 + 24 + 16 * samples;
+	const uint64_t levelOffset = (headerSize + dfdSize + 7) & ~7ull;
+	const uint64_t levelSize = (uint64_t)width * height * 8;
+
+	uint32_t header[9] = { VK_FORMAT_R16G16B16A16_SFLOAT, 2, (uint32_t)width, (uint32_t)height, 0, 0, 1, 1, 0 };
+	uint32_t index[4] = { headerSize, dfdSize, 0, 0 };
+	uint64_t sgd[2] = { 0, 0 };
+	uint64_t level[3] = { levelOffset, levelSize, levelSize };
+
+	uint8_t dfd[dfdSize] = {};
+	uint32_t v = dfdSize;
+	memcpy(dfd, &v, 4);
+	v = 0;	// vendor Khronos, basic descriptor
+	memcpy(dfd + 4, &v, 4);
+	v = 2 | ((24 + 16 * samples) << 16);	// version, block size
+	memcpy(dfd + 8, &v, 4);
+	dfd[12] = 1;	// KHR_DF_MODEL_RGBSDA
+	dfd[13] = 1;	// BT709 primaries
+	dfd[14] = 1;	// linear transfer
+	dfd[20] = 8;	// bytes per plane
+	const uint8_t channels[samples] = { 0, 1, 2, 15 };
+	for (uint32_t i = 0; i < samples; i++)
+	{
+		uint8_t *sample = dfd + 28 + i * 16;
+		uint16_t bitOffset = (uint16_t)(i * 16);
+		memcpy(sample, &bitOffset, 2);
+		sample[2] = 15;	// bit length - 1
+		sample[3] = channels[i] | 0x80 | 0x40;	// float, signed
+		uint32_t lower = 0xBF800000, upper = 0x3F800000;	// -1.0f, 1.0f
+		memcpy(sample + 8, &lower, 4);
+		memcpy(sample + 12, &upper, 4);
+	}
+
+	const uint8_t padding[8] = {};
+	bool ok = fwrite(identifier, sizeof(identifier), 1, f) == 1 &&
+		fwrite(header, sizeof(header), 1, f) == 1 &&
+		fwrite(index, sizeof(index), 1, f) == 1 &&
+		fwrite(sgd, sizeof(sgd), 1, f) == 1 &&
+		fwrite(level, sizeof(level), 1, f) == 1 &&
+		fwrite(dfd, sizeof(dfd), 1, f) == 1 &&
+		(levelOffset == headerSize + dfdSize || fwrite(padding, levelOffset - headerSize - dfdSize, 1, f) == 1) &&
+		(!levelSize || fwrite(data, levelSize, 1, f) == 1);
+	fclose(f);
+	return ok;
+}
+
 void createDirs(std::string path)
 {
 	size_t p = 0;
@@ -73,8 +139,16 @@ bool Texture::save(const char *path, bool verbose)
 {
 	createDirs(path);
 
-	int bpp = (format == RGB8 ? 3 : 4);
-	int r = stbi_write_png(path, width, height, bpp, data.data(), bpp * width);
+	int r;
+	if (format == RGBA16F)
+	{
+		r = writeKtx2(path, width, height, data.data());
+	}
+	else
+	{
+		int bpp = pixelSize();
+		r = stbi_write_png(path, width, height, bpp, data.data(), bpp * width);
+	}
 	if(verbose)
 		printf("Writing: %s \t%s\n", path, r ? "success" : "failed");
 	return !!r;
@@ -11,7 +11,8 @@ public:
 	enum Format
 	{
 		RGB8,
-		RGBA8
+		RGBA8,
+		RGBA16F	// half floats, saved as ktx2
 	};
 
 	Texture();
@@ -23,6 +24,7 @@ public:
 	uint8_t *get(int x, int y);
 	void set(int x, int y, uint8_t *color);
 	bool save(const char *path, bool verbose);
+	int pixelSize() const;
 
 	int width = 0;
 	int height = 0;
@@ -31,5 +33,6 @@ public:
 	std::string name;
 };
 
-bool LoadMipTexture(const uint8_t *data, Texture &tex, int type = 67);
+// mip selects one of the smaller levels of a miptex, false if the lump is broken or doesn't fit in size
+bool LoadMipTexture(const uint8_t *data, size_t size, Texture &tex, int type = 67, int mip = 0);
 bool LoadVtfTexture(const uint8_t *data, size_t size, Texture &tex, bool scan);
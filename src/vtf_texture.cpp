@@ -3,6 +3,7 @@
 #include "texture.h"
 #include "vtf.h"
 #include "rgbcx.h"
+#include "cpu.h"
 #include <cstring>
 
 int getSize(int width, int height, int depth, eVtfFormat fmt)
@@ -171,14 +172,7 @@ bool LoadVtfTexture(const uint8_t *data, size_t size, Texture &tex, bool scan)
 		memcpy(&tex.data[0], data + offset, faceSize);
 		if (hdr.imageFormat == eVtfFormat::BGR888)
 		{
-			uint8_t *td = &tex.data[0];
-			for (int i = 0; i < hdr.width * hdr.height; i++)
-			{
-				uint8_t t = td[0];
-				td[0] = td[2];
-				td[2] = t;
-				td += 3;
-			}
+			kernels().swapRB(&tex.data[0], hdr.width * hdr.height, 3, false);
 		}
 	}
 	else if (hdr.imageFormat == eVtfFormat::RGBA8888 || hdr.imageFormat == eVtfFormat::BGRA8888 || hdr.imageFormat == eVtfFormat::BGRX8888)
@@ -199,16 +193,7 @@ bool LoadVtfTexture(const uint8_t *data, size_t size, Texture &tex, bool scan)
 		}
 		else if (hdr.imageFormat != eVtfFormat::RGBA8888)
 		{
-			uint8_t *td = &tex.data[0];
-			for (int i = 0; i < hdr.width * hdr.height; i++)
-			{
-				uint8_t t = td[0];
-				td[0] = td[2];
-				td[2] = t;
-				if (hdr.imageFormat == eVtfFormat::BGRX8888)
-					td[3] = 255;
-				td += 4;
-			}
+			kernels().swapRB(&tex.data[0], hdr.width * hdr.height, 4, hdr.imageFormat == eVtfFormat::BGRX8888);
 		}
 	}
 	else if (hdr.imageFormat == eVtfFormat::UV88) {
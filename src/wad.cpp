@@ -1,77 +1,325 @@
 // Copyright (c) 2022 Alexey Ivanchukov (lewa_j)
 #include "wad.h"
+#include "texture.h"
 #include <cerrno>
 #include <cstring>
+#include <cctype>
+#include <utility>
+#include <filesystem>
+#include <algorithm>
+#include <sys/stat.h>
 
-#ifdef __linux__
-#include <strings.h>
-#define strnicmp strncasecmp
-#elif _MSC_VER
-#define strnicmp _strnicmp
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
-WadFile::~WadFile()
+uint32_t WadLumpIndex::hashName(const char *name, char *folded)
+{
+	// FNV-1a of the lowercase name, lump names are up to 16 chars and not always terminated
+	uint32_t h = 2166136261u;
+	int i = 0;
+	for (; i < 16 && name[i]; i++)
+	{
+		folded[i] = (char)tolower((unsigned char)name[i]);
+		h = (h ^ (uint8_t)folded[i]) * 16777619u;
+	}
+	memset(folded + i, 0, 16 - i);
+	return h;
+}
+
+void WadLumpIndex::init(size_t count)
+{
+	// at most half full, so probe runs stay short
+	size_t size = 16;
+	while (size < count * 2)
+		size *= 2;
+	slots.assign(size, {});
+}
+
+void WadLumpIndex::add(const char *name, int wad, int lump)
 {
-	if(f)
+	char folded[16];
+	const size_t mask = slots.size() - 1;
+	for (size_t i = hashName(name, folded) & mask;; i = (i + 1) & mask)
 	{
-		fclose(f);
-		f = 0;
+		slot_t &slot = slots[i];
+		if (slot.wad == -1)
+		{
+			memcpy(slot.name, folded, sizeof(folded));
+			slot.wad = wad;
+			slot.lump = lump;
+			return;
+		}
+		if (!memcmp(slot.name, folded, sizeof(folded)))
+			return;
 	}
 }
 
+bool WadLumpIndex::find(const char *name, int &wad, int &lump) const
+{
+	if (slots.empty())
+		return false;
+	char folded[16];
+	const size_t mask = slots.size() - 1;
+	for (size_t i = hashName(name, folded) & mask; slots[i].wad != -1; i = (i + 1) & mask)
+	{
+		if (!memcmp(slots[i].name, folded, sizeof(folded)))
+		{
+			wad = slots[i].wad;
+			lump = slots[i].lump;
+			return true;
+		}
+	}
+	return false;
+}
+
+WadFile::WadFile(WadFile &&other) noexcept
+{
+	*this = std::move(other);
+}
+
+WadFile &WadFile::operator=(WadFile &&other) noexcept
+{
+	if (this == &other)
+		return *this;
+	unmap();
+	lumps = std::move(other.lumps);
+	index = std::move(other.index);
+	mapping = std::exchange(other.mapping, nullptr);
+	mappingSize = std::exchange(other.mappingSize, 0);
+#ifdef _WIN32
+	mappingHandle = std::exchange(other.mappingHandle, nullptr);
+#endif
+	return *this;
+}
+
+WadFile::~WadFile()
+{
+	unmap();
+}
+
+void WadFile::unmap()
+{
+	if (!mapping)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(mapping);
+	CloseHandle(mappingHandle);
+	mappingHandle = nullptr;
+#else
+	munmap((void *)mapping, mappingSize);
+#endif
+	mapping = nullptr;
+	mappingSize = 0;
+}
+
 bool WadFile::load(const char *path)
 {
-	f = fopen(path, "rb");
-	if (!f)
+	unmap();
+	lumps.clear();
+
+	// the whole file is mapped read-only, lumps are read in place
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Error: can't open %s: error %lu\n", path, GetLastError());
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	mappingSize = (size_t)fileSize.QuadPart;
+	if (mappingSize)
+	{
+		mappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mappingHandle)
+			mapping = (const uint8_t *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+	CloseHandle(file);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
 	{
 		fprintf(stderr, "Error: can't open %s: %s\n", path, strerror(errno));
 		return false;
 	}
+	struct stat statBuffer;
+	mappingSize = fstat(fd, &statBuffer) ? 0 : (size_t)statBuffer.st_size;
+	if (mappingSize)
+	{
+		void *p = mmap(nullptr, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+			mapping = (const uint8_t *)p;
+	}
+	close(fd);
+#endif
 
-	header_t header;
-	fread(&header, sizeof(header), 1, f);
+	header_t header = {};
+	if (!mapping || mappingSize < sizeof(header))
+	{
+		fprintf(stderr, "Error: can't map %s\n", path);
+		unmap();
+		return false;
+	}
+	memcpy(&header, mapping, sizeof(header));
 
 	if (header.ident != IDWAD3HEADER)
 	{
 		fprintf(stderr, "Error: unknown ident %d (%c%c%c%c) in %s\n", header.ident, 
 			(char)header.ident, char(header.ident >> 8), char(header.ident >> 16), char(header.ident >> 24), path);
+		unmap();
 		return false;
 	}
 
-	lumps.resize(header.numlumps);
-	if (header.numlumps)
+	if (header.numlumps < 0 || header.infotableofs < 0 || (uint64_t)header.infotableofs + (uint64_t)header.numlumps * sizeof(lumpinfo_t) > mappingSize)
 	{
-		fseek(f, header.infotableofs, SEEK_SET);
-		fread(&lumps[0], sizeof(lumps[0]), lumps.size(), f);
+		fprintf(stderr, "Error: lump table of %s is out of the file\n", path);
+		unmap();
+		return false;
 	}
+	lumps.resize(header.numlumps);
+	if (header.numlumps)
+		memcpy(&lumps[0], mapping + header.infotableofs, lumps.size() * sizeof(lumps[0]));
+
+	index.init(lumps.size());
+	for (int i = 0; i < lumps.size(); i++)
+		index.add(lumps[i].name, 0, i);
 
 	printf("Loaded %s with %zu lumps\n", path, lumps.size());
 
 	return true;
 }
 
-bool WadFile::getLump(int index, std::vector<uint8_t> &data)
+std::span<const uint8_t> WadFile::getLump(int index) const
 {
 	if (index < 0 || index >= lumps.size())
-		return false;
+		return {};
 
-	data.resize(lumps[index].disksize);
-	fseek(f, lumps[index].filepos, SEEK_SET);
-	fread(&data[0], sizeof(data[0]), data.size(), f);
+	// compressed lumps are not supported by the engine either
+	const lumpinfo_t &lump = lumps[index];
+	if (lump.attribs != 0 || lump.filepos < 0 || lump.disksize < 0 || (uint64_t)lump.filepos + lump.disksize > mappingSize)
+		return {};
 
-	return true;
+	return { mapping + lump.filepos, (size_t)lump.disksize };
 }
 
-bool WadFile::findLump(const char *name, std::vector<uint8_t> &data)
+int WadFile::findLumpIndex(const char *name) const
 {
-	int i = 0;
-	for (; i < lumps.size(); i++)
+	int wad, lump;
+	if (!index.find(name, wad, lump))
+		return -1;
+	return lump;
+}
+
+std::span<const uint8_t> WadFile::findLump(const char *name) const
+{
+	return getLump(findLumpIndex(name));
+}
+
+WadCache &WadCache::shared()
+{
+	static WadCache cache;
+	return cache;
+}
+
+std::shared_ptr<const WadFile> WadCache::open(const std::string &path)
+{
+	struct stat statBuffer;
+	if (stat(path.c_str(), &statBuffer))
+		return nullptr;
+
+	// one entry per file, however the path to it is spelled
+	std::error_code error;
+	std::string key = std::filesystem::weakly_canonical(path, error).string();
+	if (error)
+		key = path;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	wad_t &entry = wads[key];
+	entry.lastUse = mapCount;
+	if (entry.wad && entry.mtime == (int64_t)statBuffer.st_mtime && entry.size == (int64_t)statBuffer.st_size)
+		return entry.wad;
+
+	// the file changed since it was loaded, textures of the old one go away with it
+	if (entry.wad)
 	{
-		if (!strnicmp(name, lumps[i].name, 16))
-			break;
+		std::erase_if(textures, [&](const auto &it)
+		{
+			if (it.first.first != entry.wad.get())
+				return false;
+			textureBytes -= it.second.bytes;
+			return true;
+		});
+	}
+
+	auto wad = std::make_shared<WadFile>();
+	if (!wad->load(path.c_str()))
+	{
+		wads.erase(key);
+		return nullptr;
+	}
+	entry.mtime = (int64_t)statBuffer.st_mtime;
+	entry.size = (int64_t)statBuffer.st_size;
+	entry.wad = std::move(wad);
+	return entry.wad;
+}
+
+std::shared_ptr<const Texture> WadCache::texture(const std::shared_ptr<const WadFile> &wad, int lump)
+{
+	const auto key = std::make_pair(wad.get(), lump);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = textures.find(key);
+		if (it != textures.end())
+		{
+			it->second.lastUse = mapCount;
+			return it->second.texture;
+		}
+	}
+
+	// decoded outside the lock, a texture decoded twice at the same time keeps the first copy
+	std::span<const uint8_t> data = wad->getLump(lump);
+	auto tex = std::make_shared<Texture>();
+	if (data.empty() || !LoadMipTexture(data.data(), data.size(), *tex))
+		tex = nullptr;
+
+	const size_t bytes = tex ? tex->data.size() : 0;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto [it, added] = textures.try_emplace(key, texture_t{ wad, std::move(tex), bytes, mapCount });
+	if (added)
+		textureBytes += bytes;
+	it->second.lastUse = mapCount;
+	return it->second.texture;
+}
+
+void WadCache::release(size_t budget)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const bool overBudget = textureBytes > budget;
+	if (overBudget)
+	{
+		std::vector<decltype(textures)::iterator> order;
+		order.reserve(textures.size());
+		for (auto it = textures.begin(); it != textures.end(); ++it)
+			order.push_back(it);
+		std::stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return a->second.lastUse < b->second.lastUse; });
+		for (auto it : order)
+		{
+			if (textureBytes <= budget)
+				break;
+			textureBytes -= it->second.bytes;
+			textures.erase(it);
+		}
 	}
-	if (i == lumps.size())
-		return false;
 
-	return getLump(i, data);
+	// wads stay mapped and indexed for the next maps. Over the budget the ones the last map didn't use and no
+	// texture refers to are closed
+	if (overBudget)
+		std::erase_if(wads, [&](const auto &it) { return it.second.wad.use_count() == 1 && it.second.lastUse < mapCount; });
+	mapCount++;
 }
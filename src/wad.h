@@ -3,8 +3,37 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
 #include <vector>
 
+class Texture;
+
+// open addressing table of lump names, case-insensitive like the engine lookup. A name keeps the first
+// wad and lump it was added with
+class WadLumpIndex
+{
+public:
+	void init(size_t count);
+	void add(const char *name, int wad, int lump);
+	// false if the name is missing
+	bool find(const char *name, int &wad, int &lump) const;
+
+private:
+	struct slot_t
+	{
+		char name[16];	// lowercase, zero padded
+		int32_t wad = -1;	// -1 - empty slot
+		int32_t lump = -1;
+	};
+	std::vector<slot_t> slots;
+
+	static uint32_t hashName(const char *name, char *folded);
+};
+
 class WadFile
 {
 public:
@@ -15,6 +44,11 @@ public:
 		TYP_MIPTEX = 0x43
 	};
 
+	WadFile() = default;
+	WadFile(WadFile &&other) noexcept;
+	WadFile &operator=(WadFile &&other) noexcept;
+	WadFile(const WadFile &) = delete;
+	WadFile &operator=(const WadFile &) = delete;
 	~WadFile();
 
 	struct header_t
@@ -36,10 +70,64 @@ public:
 		char	name[16];
 	};
 
-	FILE *f = nullptr;
 	std::vector<lumpinfo_t> lumps;
+	WadLumpIndex index;
 
 	bool load(const char *path);
-	bool getLump(int index, std::vector<uint8_t> &data);
-	bool findLump(const char *name, std::vector<uint8_t> &data);
+	// lump data inside the mapped file, empty if the lump is compressed or doesn't fit in the file
+	std::span<const uint8_t> getLump(int index) const;
+	// the first lump with the name, case-insensitive. -1 if there is none
+	int findLumpIndex(const char *name) const;
+	std::span<const uint8_t> findLump(const char *name) const;
+
+private:
+	void unmap();
+
+	const uint8_t *mapping = nullptr;
+	size_t mappingSize = 0;
+#ifdef _WIN32
+	void *mappingHandle = nullptr;
+#endif
+};
+
+// wads shared by all maps of a run, keyed by the canonical path and checked against the file time and size.
+// Loaded wads and the textures decoded from them are read-only, so concurrent map jobs can share them.
+// release() after every map keeps the decoded textures under a byte budget
+class WadCache
+{
+public:
+	// decoded texture bytes kept from one map to the next
+	static constexpr size_t TEXTURE_BUDGET = size_t(256) << 20;
+
+	static WadCache &shared();
+
+	// nullptr if the file doesn't exist or isn't a wad
+	std::shared_ptr<const WadFile> open(const std::string &path);
+	// miptex lump decoded once per wad, nullptr if it's broken
+	std::shared_ptr<const Texture> texture(const std::shared_ptr<const WadFile> &wad, int lump);
+	// ends a map: the textures used the longest time ago go until the rest fits in the budget. Wads stay open
+	// with their lump index for the next maps unless the budget was exceeded
+	void release(size_t budget = TEXTURE_BUDGET);
+
+private:
+	struct wad_t
+	{
+		int64_t mtime = 0;
+		int64_t size = 0;
+		std::shared_ptr<const WadFile> wad;
+		uint64_t lastUse = 0;	// the map which opened it last
+	};
+	struct texture_t
+	{
+		std::shared_ptr<const WadFile> wad;	// keeps the key pointer valid
+		std::shared_ptr<const Texture> texture;
+		size_t bytes = 0;
+		uint64_t lastUse = 0;	// the map which asked for it last
+	};
+
+	std::mutex mutex;
+	std::map<std::string, wad_t> wads;
+	std::map<std::pair<const WadFile *, int>, texture_t> textures;
+	size_t textureBytes = 0;
+	uint64_t mapCount = 0;
 };